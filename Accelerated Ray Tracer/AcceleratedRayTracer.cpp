@@ -1,170 +1,465 @@
-﻿#include "AcceleratedRayTracer.h"
-
-const int width = 800, height = 600; 
-int cnt, frameCnt; bool f; float lastTime, currentTime, lastx, lasty;
-vector<FlattenedBVHNode> flattenedBVH;
-Camera camera(vec3(0.0f, 0.35f, 0.7f), vec3(0.0f, 0.35f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
-
-void mouse_callback(GLFWwindow* window, double xpos, double ypos)
-{
-    if (!f) { f = 1; lastx = xpos, lasty = ypos; return; }
-    float daltax = xpos - lastx, daltay = ypos - lasty;
-    lastx = xpos, lasty = ypos;
-    camera.ProcessMouseMovement(daltax, daltay);
-}
-
-int main() 
-{
-    if (!glfwInit()) 
-    {
-        std::cerr << "Failed to initialize GLFW" << std::endl;
-        return -1;
-    }
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-    GLFWwindow* window = glfwCreateWindow(width, height, "Ray Tracing", nullptr, nullptr);
-    if (!window) 
-    {
-        std::cerr << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return -1;
-    }
-    glfwMakeContextCurrent(window); 
-    glfwSetCursorPosCallback(window, mouse_callback);
-
-    glewExperimental = GL_TRUE;
-    if (glewInit() != GLEW_OK) 
-    {
-        std::cerr << "Failed to initialize GLEW" << std::endl;
-        glfwTerminate();
-        return -1;
-    }
-
-    glViewport(0, 0, width, height);
-
-    Shader shader("VertexShader.glsl", "FragmentShader.glsl");
-
-    Model model;
-    if (!model.LoadModel("Bunny_High.obj")) 
-    {
-        cerr << "Failed to load model" << endl;
-        return -1;
-    }
-
-    auto rootBVH = model.BuildBVH(0, model.triangles.size());
-    model.SerializeBVH(flattenedBVH, rootBVH);
-
-    uint VAO, VBO, EBO, SSBO, BVHSSBO, CollisionSSBO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    glGenBuffers(1, &EBO);
-
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(screenVertices), screenVertices, GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(screenIndices), screenIndices, GL_STATIC_DRAW);
-
-    glGenBuffers(1, &SSBO);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Triangle) * model.triangles.size(), &model.triangles[0], GL_STATIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, SSBO);
-    
-    glGenBuffers(1, &BVHSSBO);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, BVHSSBO);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(FlattenedBVHNode) * flattenedBVH.size(), &flattenedBVH[0], GL_STATIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, BVHSSBO);
-
-    int pixelCount = width * height;
-    glGenBuffers(1, &CollisionSSBO);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, CollisionSSBO);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(int) * pixelCount, NULL, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, CollisionSSBO);
-
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
-    glBindVertexArray(0);
-
-    while (!glfwWindowShouldClose(window)) 
-    {
-        cnt++; frameCnt++; currentTime = glfwGetTime();
-        if (currentTime - lastTime >= 1.0) 
-        { 
-            double fps = frameCnt / (currentTime - lastTime);
-            std::stringstream ss;
-            ss << "Ray Tracing - FPS: " << fps;
-            glfwSetWindowTitle(window, ss.str().c_str());
-            frameCnt = 0; lastTime = currentTime;
-        }
-
-        if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) glfwSetWindowShouldClose(window, true);
-        if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) camera.position += vec3(0.05) * normalize(camera.forward);
-        if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) camera.position -= vec3(0.05) * normalize(camera.right);
-        if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) camera.position -= vec3(0.05) * normalize(camera.forward);
-        if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) camera.position += vec3(0.05) * normalize(camera.right);
-        if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) camera.position += vec3(0.05) * normalize(camera.up);
-        if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) camera.position -= vec3(0.05) * normalize(camera.up);
-        if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS && cnt > 100)
-        {
-            cnt = 0; vector<int> aabbCollisions(pixelCount);
-            glBindBuffer(GL_SHADER_STORAGE_BUFFER, CollisionSSBO);
-            int* ptr = (int*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
-            memcpy(aabbCollisions.data(), ptr, sizeof(int)* pixelCount);
-            glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-
-            int num = 0, minNum = 1e9, maxNum = -1e9;
-            for (int count : aabbCollisions) 
-            {
-				num += count; minNum = std::min(minNum, count); maxNum = std::max(maxNum, count);
-            }
-            printf("Avg: %d, Min: %d, Max: %d\n", num / pixelCount, minNum, maxNum);
-
-            vector<vec3> imageData(pixelCount);
-            for (int i = 0; i < pixelCount; ++i)
-            {
-                int count = aabbCollisions[i];
-                float normalized = float(count - minNum) / float(maxNum - minNum);  
-                vec3 color = vec3(normalized, 1.0f - normalized, 0.0f); 
-                imageData[i] = color;
-            }
-
-            SaveImage("CollisionInfo.png", imageData, width, height);
-
-            int numBins = 5;
-            vector<int> histogram(numBins, 0);
-
-            int binSize = (maxNum / numBins) + 1;
-            for (int count : aabbCollisions)
-            {
-                histogram[count / binSize]++;
-            }
-			for (int i = 0; i < numBins; i++)
-			{
-				printf("Bin %d: %d\n", i, histogram[i]);
-			}
-        }
-
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        shader.use();
-
-        shader.SetUniformVec3("camera.position", camera.position);
-        shader.SetUniformVec3("camera.forward", camera.forward);
-        shader.SetUniformVec3("camera.right", camera.right);
-        shader.SetUniformVec3("camera.up", camera.up);
-        shader.SetUniform1i("triangleCount", model.triangles.size());
-        shader.SetUniform1i("bvhCount", flattenedBVH.size());
-
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-        glfwSwapBuffers(window);
-        glfwPollEvents();
-    }
-    glfwTerminate();
+﻿#include "AcceleratedRayTracer.h"
+#include "CPURayTracer.h"
+#include "BVHAnalysis.h"
+#include "Benchmark.h"
+#include "FrameTimer.h"
+#include "StatsReadback.h"
+
+const int width = 800, height = 600; 
+int cnt; bool f, captureStats; float lastTime, currentTime, lastx, lasty;
+Camera camera(vec3(0.0f, 0.35f, 0.7f), vec3(0.0f, 0.35f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+
+void mouse_callback(GLFWwindow* window, double xpos, double ypos)
+{
+    if (!f) { f = 1; lastx = xpos, lasty = ypos; return; }
+    float daltax = xpos - lastx, daltay = ypos - lasty;
+    lastx = xpos, lasty = ypos;
+    camera.ProcessMouseMovement(daltax, daltay);
+}
+
+int RenderHeadless(const Options& options)
+{
+    Scene scene;
+    ThreadPool pool(options.buildThreads);
+    if (!scene.Load(options, options.buildThreads == 1 ? nullptr : &pool))
+    {
+        cerr << "Failed to load model" << endl;
+        return -1;
+    }
+
+    if (options.refitFrames > 0)
+    {
+        scene.MakeMutable();
+        BumpDeformer deformer(scene.model.triangles);
+        BVHRefitter refitter(scene.flattenedBVH);
+        double refitTime = 0, dirtyNodes = 0, dirtyTriangles = 0;
+        for (int frame = 1; frame <= options.refitFrames; frame++)
+        {
+            int triangleBegin, triangleEnd;
+            deformer.Apply(scene.model.triangles, frame * 0.1f, triangleBegin, triangleEnd);
+            auto refitStart = std::chrono::high_resolution_clock::now();
+            refitter.Refit(scene.model.triangles, scene.model.primitives, options.buildThreads == 1 ? nullptr : &pool);
+            refitTime += SecondsSince(refitStart);
+            dirtyNodes += refitter.dirtyEnd - refitter.dirtyBegin;
+            dirtyTriangles += triangleEnd - triangleBegin;
+        }
+        printf("Refit: %d frames, %.3f ms/frame, uploads %.0f%% of nodes and %.0f%% of triangles, SAH %.2f -> %.2f (x%.2f)%s\n", options.refitFrames,
+            refitTime * 1000 / options.refitFrames, 100 * dirtyNodes / options.refitFrames / scene.nodeCount, 100 * dirtyTriangles / options.refitFrames / scene.triangleCount,
+            refitter.initialSAH, refitter.currentSAH, refitter.Degradation(), refitter.RebuildRecommended() ? ", rebuild recommended" : "");
+    }
+
+    CPURayTracer tracer(scene.triangles, scene.primitives, scene.nodes, width, height, options.layout == "dfs");
+    tracer.ordered = options.traversal == "ordered";
+
+    IndexedGeometry geometry; double indexTime = 0;
+    if (options.indexed)
+    {
+        auto indexStart = std::chrono::high_resolution_clock::now();
+        geometry.Build(scene.triangles, scene.triangleCount);
+        indexTime = SecondsSince(indexStart);
+        tracer.indexed = &geometry;
+    }
+
+    WideBVH<4> wideBVH4; WideBVH<8> wideBVH8;
+    if (options.wide == 4)
+    {
+        wideBVH4.Collapse(scene.nodes, scene.nodeCount);
+        tracer.wideBVH4 = &wideBVH4;
+    }
+    if (options.wide == 8)
+    {
+        wideBVH8.Collapse(scene.nodes, scene.nodeCount);
+        tracer.wideBVH8 = &wideBVH8;
+    }
+
+    TwoLevelBVH twoLevel; double tlasTime = 0;
+    if (options.instances > 0)
+    {
+        auto tlasStart = std::chrono::high_resolution_clock::now();
+        twoLevel.Build(MakeInstanceGrid(scene.nodes[0].aabbMin, scene.nodes[0].aabbMax, options.instances), vector<int>(options.instances, 0), scene.nodes, options.buildThreads == 1 ? nullptr : &pool);
+        tlasTime = SecondsSince(tlasStart);
+        tracer.twoLevel = &twoLevel;
+    }
+    vector<vec3> imageData;
+    QuantizedBVH<8> quantized8; QuantizedBVH<16> quantized16;
+    double binaryTime = 0;
+    if (options.quantize)
+    {
+        tracer.ordered = true;
+        binaryTime = tracer.Render(camera, imageData, options.threads);
+        tracer.ordered = options.traversal == "ordered";
+    }
+    if (options.quantize == 8)
+    {
+        quantized8.Quantize(scene.nodes, scene.nodeCount);
+        tracer.quantized8 = &quantized8;
+    }
+    if (options.quantize == 16)
+    {
+        quantized16.Quantize(scene.nodes, scene.nodeCount);
+        tracer.quantized16 = &quantized16;
+    }
+    double singleTime = options.packet ? tracer.Render(camera, imageData, options.threads) : 0;
+    tracer.packetSize = options.packet;
+    double renderTime = tracer.Render(camera, imageData, options.threads);
+
+    printf("Triangles: %d, Load: %.2f ms%s\n", scene.triangleCount, scene.loadTime * 1000, scene.fromCache ? " (cache)" : "");
+    printf("Nodes: %d, Build: %.2f ms, SAH: %.2f\n", scene.nodeCount, scene.buildTime * 1000, ComputeSAHCost(scene.nodes, scene.nodeCount));
+    if (options.treeletRounds > 0 && !scene.fromCache)
+        printf("Treelets: %d rounds, SAH %.2f -> %.2f, %.2f ms\n", options.treeletRounds, scene.buildStats.sahBeforeOptimize, ComputeSAHCost(scene.nodes, scene.nodeCount), scene.buildStats.optimizeTime * 1000);
+    if (options.wide == 4) printf("BVH4 nodes: %d, %.1f KB (binary %.1f KB)\n", int(wideBVH4.nodes.size()), wideBVH4.nodes.size() * sizeof(WideBVHNode<4>) / 1024.0, scene.nodeCount * sizeof(FlattenedBVHNode) / 1024.0);
+    if (options.wide == 8) printf("BVH8 nodes: %d, %.1f KB (binary %.1f KB)\n", int(wideBVH8.nodes.size()), wideBVH8.nodes.size() * sizeof(WideBVHNode<8>) / 1024.0, scene.nodeCount * sizeof(FlattenedBVHNode) / 1024.0);
+    if (options.indexed)
+        printf("Indexed geometry: %d vertices, %.1f KB (triangles %.1f KB, %.2fx smaller), %.2f ms\n", int(geometry.vertices.size()), geometry.ByteSize() / 1024.0,
+            scene.triangleCount * sizeof(Triangle) / 1024.0, scene.triangleCount * sizeof(Triangle) / double(std::max<size_t>(1, geometry.ByteSize())), indexTime * 1000);
+    if (options.quantize)
+    {
+        double quantizedSize = options.quantize == 8 ? quantized8.nodes.size() * sizeof(QuantizedBVHNode<8>) : quantized16.nodes.size() * sizeof(QuantizedBVHNode<16>);
+        printf("Quantized %d-bit nodes: %d, %.1f KB (binary %.1f KB, %.2fx smaller), render %.2fx of ordered binary (%.2f ms)\n", options.quantize, int(options.quantize == 8 ? quantized8.nodes.size() : quantized16.nodes.size()),
+            quantizedSize / 1024.0, scene.nodeCount * sizeof(FlattenedBVHNode) / 1024.0, scene.nodeCount * sizeof(FlattenedBVHNode) / quantizedSize, binaryTime / renderTime, binaryTime * 1000);
+    }
+    if (options.instances > 0)
+        printf("Instances: %d, TLAS nodes: %d, %.2f ms, %.1f KB shared geometry + %.1f KB instances (%.1f MB flattened)\n", options.instances, int(twoLevel.tlasNodes.size()), tlasTime * 1000,
+            (scene.triangleCount * sizeof(Triangle) + scene.nodeCount * sizeof(FlattenedBVHNode)) / 1024.0, (twoLevel.instances.size() * sizeof(Instance) + twoLevel.tlasNodes.size() * sizeof(FlattenedBVHNode)) / 1024.0,
+            options.instances * (scene.triangleCount * sizeof(Triangle) + scene.nodeCount * sizeof(FlattenedBVHNode)) / 1048576.0);
+    printf("Render: %.2f ms, %.2f Mrays/s\n", renderTime * 1000, width * height / renderTime / 1e6);
+    if (options.packet) printf("Packet %d: %.2fx over single-ray (%.2f ms)\n", options.packet, singleTime / renderTime, singleTime * 1000);
+    if (options.stats)
+    {
+        vector<TraversalStats> traversalStats;
+        tracer.MeasureTraversal(camera, traversalStats, options.buildThreads == 1 ? nullptr : &pool);
+        ReportTraversalStats(traversalStats, width, height, "TraversalStats");
+    }
+
+    SaveImage(options.outputPath.c_str(), imageData, width, height);
+    return 0;
+}
+
+void UploadRange(uint buffer, const void* data, size_t stride, int begin, int end)
+{
+    if (begin >= end) return;
+    TraceSpan trace("UploadRange");
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, stride * begin, stride * (end - begin), (const char*)data + stride * begin);
+}
+
+int ReportBuildScaling(const Options& options)
+{
+    const char* models[] = { "Bunny_Low.obj", "Bunny.obj", "Bunny_High.obj" };
+    int maxThreads = options.buildThreads > 1 ? options.buildThreads : std::max(1u, std::thread::hardware_concurrency());
+
+    printf("%-16s %8s %10s %8s %s\n", "Model", "Threads", "Build ms", "Speedup", "Identical");
+    for (const char* path : models)
+    {
+        Model source;
+        if (!source.LoadModel(path))
+        {
+            cerr << "Failed to load model " << path << endl;
+            return -1;
+        }
+
+        Model reference = source;
+        vector<FlattenedBVHNode> referenceBVH;
+        if (!BuildScene(reference, options, referenceBVH)) return -1;
+
+        double serialTime = 0;
+        for (int threads = 1; threads <= maxThreads; threads = threads == maxThreads ? threads + 1 : std::min(threads * 2, maxThreads))
+        {
+            ThreadPool pool(threads);
+            double bestTime = 1e30; bool identical = true;
+            for (int run = 0; run < 3; run++)
+            {
+                Model model = source;
+                vector<FlattenedBVHNode> bvh;
+                auto start = std::chrono::high_resolution_clock::now();
+                BuildScene(model, options, bvh, threads == 1 ? nullptr : &pool);
+                bestTime = std::min(bestTime, SecondsSince(start));
+                identical = identical && bvh.size() == referenceBVH.size()
+                    && memcmp(bvh.data(), referenceBVH.data(), sizeof(FlattenedBVHNode) * bvh.size()) == 0
+                    && memcmp(model.triangles.data(), reference.triangles.data(), sizeof(Triangle) * model.triangles.size()) == 0
+                    && model.primitives == reference.primitives;
+            }
+            if (threads == 1) serialTime = bestTime;
+            printf("%-16s %8d %10.2f %7.2fx %s\n", path, threads, bestTime * 1000, serialTime / bestTime, identical ? "yes" : "NO");
+        }
+    }
+    return 0;
+}
+
+int AnalyzeBVH(const Options& options)
+{
+    Model model;
+    if (!model.LoadModel(options.modelPath))
+    {
+        cerr << "Failed to load model " << options.modelPath << endl;
+        return -1;
+    }
+
+    ThreadPool pool(options.buildThreads);
+    vector<FlattenedBVHNode> bvh;
+    auto start = std::chrono::high_resolution_clock::now();
+    if (!BuildScene(model, options, bvh, options.buildThreads == 1 ? nullptr : &pool)) return -1;
+    double buildTime = SecondsSince(start);
+
+    BVHAnalysis analysis(bvh.data(), int(bvh.size()), model.triangles.data(), int(model.triangles.size()), model.primitives, options.buildThreads == 1 ? nullptr : &pool);
+    analysis.WriteJSON(stdout, options.modelPath, options.builder, buildTime);
+    if (!options.verify) return 0;
+
+    float reference = analysis.BruteForceEPO(options.buildThreads == 1 ? nullptr : &pool);
+    bool matches = std::abs(analysis.epo - reference) <= 1e-4f * std::max(1.0f, reference);
+    fprintf(stderr, "EPO %.4f, brute force %.4f: %s\n", analysis.epo, reference, matches ? "match" : "MISMATCH");
+    return matches ? 0 : 1;
+}
+
+int RunBenchmarks(const Options& options)
+{
+    BenchmarkSuite suite;
+    if (!suite.Run(options, width, height)) return -1;
+    if (!suite.Write(options.benchmarkPath))
+    {
+        cerr << "Failed to write benchmark results " << options.benchmarkPath << endl;
+        return -1;
+    }
+    if (options.baselinePath.empty()) return 0;
+
+    vector<BenchmarkResult> baseline;
+    if (!BenchmarkSuite::Read(options.baselinePath, baseline))
+    {
+        cerr << "Failed to read baseline " << options.baselinePath << endl;
+        return -1;
+    }
+    return suite.Compare(baseline, options.thresholds) > 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv) 
+{
+    Options options(argc, argv);
+    TraceSession traceSession(options.tracePath);
+    if (options.scaling) return ReportBuildScaling(options);
+    if (options.analyze) return AnalyzeBVH(options);
+    if (options.benchmark) return RunBenchmarks(options);
+    if (options.headless) return RenderHeadless(options);
+
+    if (!glfwInit()) 
+    {
+        std::cerr << "Failed to initialize GLFW" << std::endl;
+        return -1;
+    }
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+    GLFWwindow* window = glfwCreateWindow(width, height, "Ray Tracing", nullptr, nullptr);
+    if (!window) 
+    {
+        std::cerr << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(window); 
+    glfwSetCursorPosCallback(window, mouse_callback);
+
+    glewExperimental = GL_TRUE;
+    if (glewInit() != GLEW_OK) 
+    {
+        std::cerr << "Failed to initialize GLEW" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+
+    glViewport(0, 0, width, height);
+
+    Shader shader("VertexShader.glsl", "FragmentShader.glsl");
+
+    Scene scene;
+    ThreadPool pool(options.buildThreads);
+    if (!scene.Load(options, options.buildThreads == 1 ? nullptr : &pool)) 
+    {
+        cerr << "Failed to load model" << endl;
+        return -1;
+    }
+
+    unique_ptr<BumpDeformer> deformer; unique_ptr<BVHRefitter> refitter;
+    if (options.animate)
+    {
+        scene.MakeMutable();
+        deformer.reset(new BumpDeformer(scene.model.triangles));
+        refitter.reset(new BVHRefitter(scene.flattenedBVH));
+    }
+    GLenum usage = options.animate ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW;
+
+    uint VAO, VBO, EBO, SSBO, BVHSSBO, StatsSSBO, TLASSSBO, InstanceSSBO, QuantizedSSBO, VertexSSBO, IndexSSBO, PrimitiveSSBO;
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glGenBuffers(1, &EBO);
+
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(screenVertices), screenVertices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(screenIndices), screenIndices, GL_STATIC_DRAW);
+
+    IndexedGeometry geometry;
+    if (options.indexed) geometry.Build(scene.triangles, scene.triangleCount);
+
+    TraceSpan uploadTrace("UploadSSBOs");
+    glGenBuffers(1, &SSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Triangle) * (options.indexed ? 1 : scene.triangleCount), scene.triangles, usage);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, SSBO);
+
+    glGenBuffers(1, &VertexSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, VertexSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(vec3) * std::max<size_t>(1, geometry.vertices.size()), geometry.vertices.empty() ? NULL : geometry.vertices.data(), usage);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, VertexSSBO);
+
+    glGenBuffers(1, &IndexSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, IndexSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uvec3) * std::max<size_t>(1, geometry.indices.size()), geometry.indices.empty() ? NULL : geometry.indices.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, IndexSSBO);
+
+    glGenBuffers(1, &PrimitiveSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, PrimitiveSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint) * std::max(1, scene.primitiveCount), scene.primitives, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, PrimitiveSSBO);
+    
+    glGenBuffers(1, &BVHSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, BVHSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(FlattenedBVHNode) * scene.nodeCount, scene.nodes, usage);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, BVHSSBO);
+
+    TwoLevelBVH twoLevel;
+    vector<int> blasRoots(options.instances, 0);
+    if (options.instances > 0) twoLevel.Build(MakeInstanceGrid(scene.nodes[0].aabbMin, scene.nodes[0].aabbMax, options.instances), blasRoots, scene.nodes);
+
+    glGenBuffers(1, &TLASSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, TLASSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(FlattenedBVHNode) * std::max<size_t>(1, 2 * twoLevel.instances.size()), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, TLASSSBO);
+
+    glGenBuffers(1, &InstanceSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, InstanceSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Instance) * std::max<size_t>(1, twoLevel.instances.size()), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, InstanceSSBO);
+
+    QuantizedBVH<8> quantized8; QuantizedBVH<16> quantized16;
+    if (options.quantize == 8) quantized8.Quantize(scene.nodes, scene.nodeCount);
+    if (options.quantize == 16) quantized16.Quantize(scene.nodes, scene.nodeCount);
+    const void* quantizedData = options.quantize == 8 ? (const void*)quantized8.nodes.data() : (const void*)quantized16.nodes.data();
+    size_t quantizedSize = quantized8.nodes.size() * sizeof(QuantizedBVHNode<8>) + quantized16.nodes.size() * sizeof(QuantizedBVHNode<16>);
+
+    glGenBuffers(1, &QuantizedSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, QuantizedSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(sizeof(uint), quantizedSize), quantizedSize ? quantizedData : NULL, usage);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, QuantizedSSBO);
+
+    int pixelCount = width * height;
+    uploadTrace.End();
+    glGenBuffers(1, &StatsSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, StatsSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(TraversalStats) * pixelCount, NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, StatsSSBO);
+
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
+
+    FrameTimer frameTimer(options.frameLogPath);
+    StatsReadback readback(width, height, "TraversalStats");
+    while (!glfwWindowShouldClose(window)) 
+    {
+        TraceSpan frameTrace("Frame");
+        frameTimer.BeginFrame();
+        cnt++; currentTime = glfwGetTime();
+        if (currentTime - lastTime >= 1.0) 
+        { 
+            std::stringstream ss;
+            ss << "Ray Tracing - " << frameTimer.Summary();
+            if (refitter) ss << " - SAH x" << refitter->Degradation() << (refitter->RebuildRecommended() ? " (rebuild recommended)" : "");
+            glfwSetWindowTitle(window, ss.str().c_str());
+            frameTimer.Report(currentTime);
+            lastTime = currentTime;
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) glfwSetWindowShouldClose(window, true);
+        if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) camera.position += vec3(0.05) * normalize(camera.forward);
+        if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) camera.position -= vec3(0.05) * normalize(camera.right);
+        if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) camera.position -= vec3(0.05) * normalize(camera.forward);
+        if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) camera.position += vec3(0.05) * normalize(camera.right);
+        if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) camera.position += vec3(0.05) * normalize(camera.up);
+        if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) camera.position -= vec3(0.05) * normalize(camera.up);
+        if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS && cnt > 100)
+        {
+            cnt = 0;
+            captureStats = true;
+        }
+
+        if (options.animate)
+        {
+            TraceSpan trace("Refit");
+            int triangleBegin, triangleEnd;
+            deformer->Apply(scene.model.triangles, currentTime, triangleBegin, triangleEnd);
+            refitter->Refit(scene.model.triangles, scene.model.primitives, options.buildThreads == 1 ? nullptr : &pool);
+            if (options.indexed)
+            {
+                geometry.Refresh(scene.triangles, options.buildThreads == 1 ? nullptr : &pool);
+                UploadRange(VertexSSBO, geometry.vertices.data(), sizeof(vec3), 0, int(geometry.vertices.size()));
+            }
+            else UploadRange(SSBO, scene.triangles, sizeof(Triangle), triangleBegin, triangleEnd);
+            UploadRange(BVHSSBO, scene.nodes, sizeof(FlattenedBVHNode), refitter->dirtyBegin, refitter->dirtyEnd);
+            if (options.quantize == 8)
+            {
+                quantized8.Quantize(scene.nodes, scene.nodeCount);
+                UploadRange(QuantizedSSBO, quantized8.nodes.data(), sizeof(QuantizedBVHNode<8>), 0, int(quantized8.nodes.size()));
+            }
+            if (options.quantize == 16)
+            {
+                quantized16.Quantize(scene.nodes, scene.nodeCount);
+                UploadRange(QuantizedSSBO, quantized16.nodes.data(), sizeof(QuantizedBVHNode<16>), 0, int(quantized16.nodes.size()));
+            }
+        }
+
+        if (options.instances > 0)
+        {
+            TraceSpan trace("BuildTLAS");
+            twoLevel.Build(MakeInstanceGrid(scene.nodes[0].aabbMin, scene.nodes[0].aabbMax, options.instances, currentTime), blasRoots, scene.nodes, options.buildThreads == 1 ? nullptr : &pool);
+            UploadRange(TLASSSBO, twoLevel.tlasNodes.data(), sizeof(FlattenedBVHNode), 0, int(twoLevel.tlasNodes.size()));
+            UploadRange(InstanceSSBO, twoLevel.instances.data(), sizeof(Instance), 0, int(twoLevel.instances.size()));
+        }
+
+        TraceSpan drawTrace("Draw");
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        shader.use();
+
+        shader.SetUniformVec3("camera.position", camera.position);
+        shader.SetUniformVec3("camera.forward", camera.forward);
+        shader.SetUniformVec3("camera.right", camera.right);
+        shader.SetUniformVec3("camera.up", camera.up);
+        shader.SetUniform1i("triangleCount", scene.triangleCount);
+        shader.SetUniform1i("primitiveCount", scene.primitiveCount);
+        shader.SetUniform1i("bvhCount", scene.nodeCount);
+        shader.SetUniform1i("bvhLayout", options.layout == "dfs");
+        shader.SetUniform1i("bvhTraversal", options.traversal == "ordered");
+        shader.SetUniform1i("instanceCount", options.instances);
+        shader.SetUniform1i("quantizedBits", options.quantize);
+        shader.SetUniform1i("indexedGeometry", options.indexed);
+
+        glBindVertexArray(VAO);
+        frameTimer.BeginGPU();
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        frameTimer.EndGPU();
+        glBindVertexArray(0);
+        if (captureStats || options.stats) captureStats = !readback.Capture(StatsSSBO);
+        readback.Update();
+
+        glfwSwapBuffers(window);
+        glfwPollEvents();
+    }
+    frameTimer.PrintSession();
+    readback.Finish();
+    if (readback.skippedFrames) printf("Stats readback: %d captures skipped while the worker was busy\n", readback.skippedFrames);
+    glfwTerminate();
 }
\ No newline at end of file
@@ -1,127 +1,385 @@
-#pragma once
-#define GLM_ENABLE_EXPERIMENTAL
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "RayTraceModels.h"
-#include "stb_image_write.h"
-
-float screenVertices[] = 
-{
-	-1.0f, -1.0f, 0.0f,  0.0f, 0.0f,
-	 1.0f, -1.0f, 0.0f,  1.0f, 0.0f,
-	 1.0f,  1.0f, 0.0f,  1.0f, 1.0f,
-	-1.0f,  1.0f, 0.0f,  0.0f, 1.0f 
-};
-uint screenIndices[] = {
-	0, 1, 2,
-	2, 3, 0
-};
-
-vec3 MinVec3(const vec3& a, const vec3& b)
-{
-	return vec3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
-}
-
-vec3 MaxVec3(const vec3& a, const vec3& b) 
-{
-	return vec3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
-}
-
-void SaveImage(const char* filename, const vector<vec3>& imageData, int width, int height)
-{
-	vector<unsigned char> outputImage(width * height * 3);
-
-	for (int i = 0; i < width * height; ++i)
-	{
-		vec3 color = imageData[i];
-		outputImage[i * 3] = static_cast<unsigned char>(std::min(color.r, 1.0f) * 255);
-		outputImage[i * 3 + 1] = static_cast<unsigned char>(std::min(color.g, 1.0f) * 255);
-		outputImage[i * 3 + 2] = static_cast<unsigned char>(std::min(color.b, 1.0f) * 255);
-	}
-
-	stbi_write_png(filename, width, height, 3, outputImage.data(), width * 3);
-}
-
-struct Shader
-{
-public:
-	string vertexString, fragmentString;
-	const char* vertexSource; const char* fragmentSource;
-	uint ID, vertex, fragment;
-	Shader(const char* vertexPath, const char* fragmentPath)
-	{
-		ifstream vertexFile, fragmentFile;
-		vertexFile.open(vertexPath), fragmentFile.open(fragmentPath);
-		stringstream vertexStream, fragmentStream;
-		vertexStream << vertexFile.rdbuf(), fragmentStream << fragmentFile.rdbuf();
-		vertexString = vertexStream.str(), fragmentString = fragmentStream.str();
-		vertexSource = vertexString.c_str(); fragmentSource = fragmentString.c_str();
-		glewExperimental = GL_TRUE; glewInit();
-		vertex = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vertex, 1, &vertexSource, NULL);
-		glCompileShader(vertex);
-		fragment = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fragment, 1, &fragmentSource, NULL);
-		glCompileShader(fragment);
-		ID = glCreateProgram();
-		glAttachShader(ID, vertex), glAttachShader(ID, fragment);
-		glLinkProgram(ID);
-		glDeleteShader(vertex), glDeleteShader(fragment);
-	}
-	void use() { glUseProgram(ID); }
-	void SetUniformMat4(const char* name, mat4 mat)
-	{
-		glUniformMatrix4fv(glGetUniformLocation(ID, name), 1, GL_FALSE, value_ptr(mat));
-	}
-	void SetUniformVec2(const char* name, vec2 vector)
-	{
-		glUniform2f(glGetUniformLocation(ID, name), vector.x, vector.y);
-	}
-	void SetUniformVec3(const char* name, vec3 vector)
-	{
-		glUniform3f(glGetUniformLocation(ID, name), vector.x, vector.y, vector.z);
-	}
-	void SetUniform1f(const char* name, float f)
-	{
-		glUniform1f(glGetUniformLocation(ID, name), f);
-	}
-	void SetUniform1i(const char* name, int slot)
-	{
-		glUniform1i(glGetUniformLocation(ID, name), slot);
-	}
-};
-
-
-struct Camera
-{
-public:
-	vec3 position, forward, right, up, worldUp; float yaw, pitch;
-	Camera(vec3 _position, vec3 target, vec3 worldup)
-	{
-		position = _position; worldUp = worldup;
-		forward = normalize(target - position);
-		right = normalize(cross(forward, worldUp));
-		up = -normalize(cross(forward, right));
-	}
-	Camera(vec3 _position, float pitch, float yaw, vec3 worldup)
-	{
-		position = _position; worldUp = worldup; pitch = pitch; yaw = yaw;
-		forward = vec3(cos(pitch) * sin(yaw), sin(pitch), cos(pitch) * cos(yaw));
-		right = normalize(cross(forward, worldUp));
-		up = -normalize(cross(forward, right));
-	}
-	mat4 GetViewMatrix()
-	{
-		return lookAt(position, forward + position, worldUp);
-	}
-	void ProcessMouseMovement(float daltax, float daltay)
-	{
-		yaw -= 0.01 * daltax; pitch -= 0.01 * daltay;
-		UpdateCameraVectors();
-	}
-	void UpdateCameraVectors()
-	{
-		forward = vec3(cos(pitch) * sin(yaw), sin(pitch), cos(pitch) * cos(yaw));
-		right = normalize(cross(forward, worldUp));
-		up = -normalize(cross(forward, right));
-	}
+#pragma once
+#define GLM_ENABLE_EXPERIMENTAL
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <chrono>
+#include <memory>
+#include "RayTraceModels.h"
+#include "SceneCache.h"
+#include "TreeletOptimizer.h"
+#include "BVHRefit.h"
+#include "TwoLevelBVH.h"
+#include "stb_image_write.h"
+
+float screenVertices[] = 
+{
+	-1.0f, -1.0f, 0.0f,  0.0f, 0.0f,
+	 1.0f, -1.0f, 0.0f,  1.0f, 0.0f,
+	 1.0f,  1.0f, 0.0f,  1.0f, 1.0f,
+	-1.0f,  1.0f, 0.0f,  0.0f, 1.0f 
+};
+uint screenIndices[] = {
+	0, 1, 2,
+	2, 3, 0
+};
+
+vec3 MinVec3(const vec3& a, const vec3& b)
+{
+	return vec3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
+
+vec3 MaxVec3(const vec3& a, const vec3& b) 
+{
+	return vec3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
+
+void SaveImage(const char* filename, const vector<vec3>& imageData, int width, int height)
+{
+	vector<unsigned char> outputImage(width * height * 3);
+
+	for (int i = 0; i < width * height; ++i)
+	{
+		vec3 color = imageData[i];
+		outputImage[i * 3] = static_cast<unsigned char>(std::min(color.r, 1.0f) * 255);
+		outputImage[i * 3 + 1] = static_cast<unsigned char>(std::min(color.g, 1.0f) * 255);
+		outputImage[i * 3 + 2] = static_cast<unsigned char>(std::min(color.b, 1.0f) * 255);
+	}
+
+	stbi_write_png(filename, width, height, 3, outputImage.data(), width * 3);
+}
+
+struct Shader
+{
+public:
+	string vertexString, fragmentString;
+	const char* vertexSource; const char* fragmentSource;
+	uint ID, vertex, fragment;
+	Shader(const char* vertexPath, const char* fragmentPath)
+	{
+		TraceSpan trace("CompileShaders");
+		ifstream vertexFile, fragmentFile;
+		vertexFile.open(vertexPath), fragmentFile.open(fragmentPath);
+		stringstream vertexStream, fragmentStream;
+		vertexStream << vertexFile.rdbuf(), fragmentStream << fragmentFile.rdbuf();
+		vertexString = vertexStream.str(), fragmentString = fragmentStream.str();
+		vertexSource = vertexString.c_str(); fragmentSource = fragmentString.c_str();
+		glewExperimental = GL_TRUE; glewInit();
+		vertex = glCreateShader(GL_VERTEX_SHADER);
+		glShaderSource(vertex, 1, &vertexSource, NULL);
+		glCompileShader(vertex);
+		fragment = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(fragment, 1, &fragmentSource, NULL);
+		glCompileShader(fragment);
+		ID = glCreateProgram();
+		glAttachShader(ID, vertex), glAttachShader(ID, fragment);
+		glLinkProgram(ID);
+		glDeleteShader(vertex), glDeleteShader(fragment);
+	}
+	void use() { glUseProgram(ID); }
+	void SetUniformMat4(const char* name, mat4 mat)
+	{
+		glUniformMatrix4fv(glGetUniformLocation(ID, name), 1, GL_FALSE, value_ptr(mat));
+	}
+	void SetUniformVec2(const char* name, vec2 vector)
+	{
+		glUniform2f(glGetUniformLocation(ID, name), vector.x, vector.y);
+	}
+	void SetUniformVec3(const char* name, vec3 vector)
+	{
+		glUniform3f(glGetUniformLocation(ID, name), vector.x, vector.y, vector.z);
+	}
+	void SetUniform1f(const char* name, float f)
+	{
+		glUniform1f(glGetUniformLocation(ID, name), f);
+	}
+	void SetUniform1i(const char* name, int slot)
+	{
+		glUniform1i(glGetUniformLocation(ID, name), slot);
+	}
+};
+
+
+struct Camera
+{
+public:
+	vec3 position, forward, right, up, worldUp; float yaw, pitch;
+	Camera(vec3 _position, vec3 target, vec3 worldup)
+	{
+		position = _position; worldUp = worldup;
+		forward = normalize(target - position);
+		right = normalize(cross(forward, worldUp));
+		up = -normalize(cross(forward, right));
+	}
+	Camera(vec3 _position, float pitch, float yaw, vec3 worldup)
+	{
+		position = _position; worldUp = worldup; pitch = pitch; yaw = yaw;
+		forward = vec3(cos(pitch) * sin(yaw), sin(pitch), cos(pitch) * cos(yaw));
+		right = normalize(cross(forward, worldUp));
+		up = -normalize(cross(forward, right));
+	}
+	mat4 GetViewMatrix()
+	{
+		return lookAt(position, forward + position, worldUp);
+	}
+	void ProcessMouseMovement(float daltax, float daltay)
+	{
+		yaw -= 0.01 * daltax; pitch -= 0.01 * daltay;
+		UpdateCameraVectors();
+	}
+	void UpdateCameraVectors()
+	{
+		forward = vec3(cos(pitch) * sin(yaw), sin(pitch), cos(pitch) * cos(yaw));
+		right = normalize(cross(forward, worldUp));
+		up = -normalize(cross(forward, right));
+	}
+};
+
+struct Options
+{
+public:
+	bool headless, scaling, analyze, verify, benchmark, stats, animate, indexed; int threads, buildThreads, benchmarkRuns, bins, mortonBits, wide, packet, treeletRounds, plocRadius, refitFrames, instances, quantize; float splitBudget;
+	string modelPath, outputPath, builder, cachePath, layout, traversal, benchmarkPath, baselinePath, thresholds, tracePath, frameLogPath;
+	Options(int argc, char** argv) : headless(false), scaling(false), analyze(false), verify(false), benchmark(false), stats(false), animate(false), indexed(false), threads(0), buildThreads(1), benchmarkRuns(3), bins(32), mortonBits(30), wide(0), packet(0), treeletRounds(0), plocRadius(16), refitFrames(0), instances(0), quantize(0), splitBudget(0.3f), modelPath("Bunny_High.obj"), outputPath("RayTrace.png"), builder("bvh"), layout("bfs"), traversal("default"), benchmarkPath("benchmark.json"), thresholds("0.1")
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			string arg = argv[i];
+			bool hasValue = i + 1 < argc;
+			if (arg == "--headless") headless = true;
+			else if (arg == "--scaling") scaling = true;
+			else if (arg == "--analyze") analyze = true;
+			else if (arg == "--verify") verify = true;
+			else if (arg == "--benchmark") benchmark = true;
+			else if (arg == "--stats") stats = true;
+			else if (arg == "--animate") animate = true;
+			else if (arg == "--indexed") indexed = true;
+			else if (arg == "--instances" && hasValue) instances = std::max(0, atoi(argv[++i]));
+			else if (arg == "--refit-frames" && hasValue) refitFrames = std::max(0, atoi(argv[++i]));
+			else if (arg == "--model" && hasValue) modelPath = argv[++i];
+			else if (arg == "--output" && hasValue) outputPath = argv[++i];
+			else if (arg == "--builder" && hasValue) builder = argv[++i];
+			else if (arg == "--cache" && hasValue) cachePath = argv[++i];
+			else if (arg == "--trace" && hasValue) tracePath = argv[++i];
+			else if (arg == "--frame-log" && hasValue) frameLogPath = argv[++i];
+			else if (arg == "--benchmark-output" && hasValue) benchmarkPath = argv[++i];
+			else if (arg == "--benchmark-runs" && hasValue) benchmarkRuns = std::max(1, atoi(argv[++i]));
+			else if (arg == "--baseline" && hasValue) baselinePath = argv[++i];
+			else if (arg == "--threshold" && hasValue) thresholds = argv[++i];
+			else if (arg == "--layout" && hasValue) layout = argv[++i];
+			else if (arg == "--traversal" && hasValue) traversal = argv[++i];
+			else if (arg == "--packet" && hasValue) packet = atoi(argv[++i]) > 8 ? 16 : 8;
+			else if (arg == "--quantize" && hasValue) quantize = atoi(argv[++i]) > 8 ? 16 : 8;
+			else if (arg == "--wide" && hasValue) wide = atoi(argv[++i]) > 4 ? 8 : 4;
+			else if (arg == "--threads" && hasValue) threads = atoi(argv[++i]);
+			else if (arg == "--build-threads" && hasValue) buildThreads = atoi(argv[++i]);
+			else if (arg == "--bins" && hasValue) bins = std::max(2, atoi(argv[++i]));
+			else if (arg == "--treelet-rounds" && hasValue) treeletRounds = std::max(0, atoi(argv[++i]));
+			else if (arg == "--split-budget" && hasValue) splitBudget = std::max(0.0f, float(atof(argv[++i])));
+			else if (arg == "--ploc-radius" && hasValue) plocRadius = std::max(1, atoi(argv[++i]));
+			else if (arg == "--morton-bits" && hasValue) mortonBits = atoi(argv[++i]) > 30 ? 63 : 30;
+			else cerr << "Unknown argument: " << arg << endl;
+		}
+	}
+};
+
+double SecondsSince(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+struct BuildStats
+{
+public:
+	float sahBeforeOptimize; double optimizeTime, serializeTime;
+	BuildStats() : sahBeforeOptimize(0), optimizeTime(0), serializeTime(0) {}
+};
+
+const char* builderNames[] = { "bvh", "sah", "binned", "sbvh", "lbvh", "ploc" };
+
+bool BuildScene(Model& model, const Options& options, vector<FlattenedBVHNode>& flattenedBVH, ThreadPool* pool = nullptr, BuildStats* stats = nullptr)
+{
+	if (options.layout != "bfs" && options.layout != "dfs")
+	{
+		cerr << "Unknown layout: " << options.layout << endl;
+		return false;
+	}
+	if (model.triangles.empty())
+	{
+		cerr << "Cannot build a BVH over a model with no triangles" << endl;
+		return false;
+	}
+
+	model.BuildReferences(pool);
+	TraceSpan buildTrace("BuildBVH", options.builder.c_str());
+	if (options.builder == "lbvh") model.BuildLBVH(flattenedBVH, options.mortonBits, pool);
+	else
+	{
+		BVHNode* rootBVH = nullptr;
+		model.nodeArena.Reset(2 * int(model.references.size()) + 1);
+		if (options.builder == "bvh") rootBVH = model.BuildBVH(0, model.triangles.size(), pool);
+		else if (options.builder == "sah") rootBVH = model.BuildBVHSAH(0, model.triangles.size(), pool);
+		else if (options.builder == "ploc") rootBVH = model.BuildPLOC(options.plocRadius, pool);
+		else if (options.builder == "sbvh") rootBVH = model.BuildSBVH(options.splitBudget, options.bins);
+		else if (options.builder == "binned") rootBVH = model.BuildBVHBinnedSAH(0, model.triangles.size(), options.bins, pool);
+		else
+		{
+			cerr << "Unknown builder: " << options.builder << endl;
+			model.references.clear();
+			return false;
+		}
+		buildTrace.End();
+		auto serializeStart = std::chrono::high_resolution_clock::now();
+		flattenedBVH.clear();
+		model.SerializeBVH(flattenedBVH, rootBVH);
+		if (stats) stats->serializeTime += SecondsSince(serializeStart);
+	}
+	buildTrace.End();
+
+	auto applyStart = std::chrono::high_resolution_clock::now();
+	model.ApplyReferences(pool);
+	if (stats) stats->serializeTime += SecondsSince(applyStart);
+	if (options.treeletRounds > 0)
+	{
+		if (stats) stats->sahBeforeOptimize = ComputeSAHCost(flattenedBVH.data(), int(flattenedBVH.size()));
+		auto optimizeStart = std::chrono::high_resolution_clock::now();
+		TreeletOptimizer(flattenedBVH).Optimize(options.treeletRounds, pool);
+		if (stats) stats->optimizeTime = SecondsSince(optimizeStart);
+	}
+	if (options.layout == "dfs")
+	{
+		auto convertStart = std::chrono::high_resolution_clock::now();
+		ConvertToDepthFirst(flattenedBVH);
+		if (stats) stats->serializeTime += SecondsSince(convertStart);
+	}
+	return true;
+}
+
+string BuilderKey(const Options& options)
+{
+	string key = options.builder;
+	if (options.builder == "binned") key += ":" + to_string(options.bins);
+	if (options.builder == "lbvh") key += ":" + to_string(options.mortonBits);
+	if (options.builder == "ploc") key += ":" + to_string(options.plocRadius);
+	if (options.builder == "sbvh") key += ":" + to_string(options.bins) + ":" + to_string(options.splitBudget);
+	if (options.treeletRounds > 0) key += ":treelet" + to_string(options.treeletRounds);
+	return key + ":" + options.layout;
+}
+
+struct Scene
+{
+public:
+	Model model;
+	vector<FlattenedBVHNode> flattenedBVH;
+	unique_ptr<SceneCache> cache;
+	const Triangle* triangles; const FlattenedBVHNode* nodes; const uint* primitives;
+	int triangleCount, nodeCount, primitiveCount; bool fromCache;
+	double loadTime, buildTime;
+	BuildStats buildStats;
+
+	Scene() : triangles(nullptr), nodes(nullptr), primitives(nullptr), triangleCount(0), nodeCount(0), primitiveCount(0), fromCache(false), loadTime(0), buildTime(0) {}
+
+	bool Load(const Options& options, ThreadPool* pool = nullptr)
+	{
+		auto loadStart = std::chrono::high_resolution_clock::now();
+		SceneCacheHeader expected = {};
+		if (!options.cachePath.empty())
+		{
+			{
+				TraceSpan trace("HashModel", options.modelPath.c_str());
+				MappedFile source(options.modelPath);
+				if (!source.IsOpen()) return false;
+				expected = MakeSceneCacheHeader(HashBytes(source.data, source.size, pool), source.size, BuilderKey(options));
+			}
+			TraceSpan trace("LoadCache", options.cachePath.c_str());
+			cache.reset(new SceneCache(options.cachePath));
+			if (cache->Matches(expected))
+			{
+				triangles = cache->triangles;
+				nodes = cache->nodes;
+				primitives = cache->primitives;
+				triangleCount = int(cache->header->triangleCount);
+				nodeCount = int(cache->header->nodeCount);
+				primitiveCount = int(cache->header->primitiveCount);
+				fromCache = true;
+				loadTime = SecondsSince(loadStart);
+				return true;
+			}
+			cache.reset();
+		}
+
+		if (!model.LoadModel(options.modelPath, pool)) return false;
+		loadTime = SecondsSince(loadStart);
+
+		auto buildStart = std::chrono::high_resolution_clock::now();
+		if (!BuildScene(model, options, flattenedBVH, pool, &buildStats)) return false;
+		buildTime = SecondsSince(buildStart);
+
+		if (!options.cachePath.empty() && !WriteSceneCache(options.cachePath, expected, model.triangles, flattenedBVH, model.primitives))
+			cerr << "Failed to write scene cache " << options.cachePath << endl;
+
+		triangles = model.triangles.data();
+		nodes = flattenedBVH.data();
+		primitives = model.primitives.empty() ? nullptr : model.primitives.data();
+		triangleCount = int(model.triangles.size());
+		nodeCount = int(flattenedBVH.size());
+		primitiveCount = int(model.primitives.size());
+		return true;
+	}
+
+	void MakeMutable()
+	{
+		if (cache)
+		{
+			model.triangles.assign(triangles, triangles + triangleCount);
+			flattenedBVH.assign(nodes, nodes + nodeCount);
+			model.primitives.assign(primitives, primitives + primitiveCount);
+			cache.reset();
+		}
+		triangles = model.triangles.data();
+		nodes = flattenedBVH.data();
+		primitives = model.primitives.empty() ? nullptr : model.primitives.data();
+	}
+};
+
+struct BumpDeformer
+{
+public:
+	vector<Triangle> rest; AABB bounds;
+
+	BumpDeformer(const vector<Triangle>& triangles) : rest(triangles)
+	{
+		for (const Triangle& tri : rest)
+		{
+			bounds.Expand(tri.v0);
+			bounds.Expand(tri.v1);
+			bounds.Expand(tri.v2);
+		}
+	}
+
+	vec3 Displace(const vec3& p, const vec3& center, float radius) const
+	{
+		vec3 offset = p - center;
+		float distance = length(offset);
+		if (distance >= radius || distance <= 0.0f) return p;
+		float falloff = 1.0f - distance / radius;
+		return p + offset / distance * (0.3f * radius * falloff * falloff);
+	}
+
+	void Apply(vector<Triangle>& triangles, float time, int& dirtyBegin, int& dirtyEnd) const
+	{
+		vec3 extent = bounds.max - bounds.min, middle = (bounds.min + bounds.max) * 0.5f;
+		vec3 center = middle + vec3(0.4f * extent.x * cos(time), 0.3f * extent.y * sin(0.7f * time), 0.4f * extent.z * sin(time));
+		float radius = 0.25f * std::max(extent.x, std::max(extent.y, extent.z));
+
+		dirtyBegin = int(triangles.size());
+		dirtyEnd = 0;
+		for (int i = 0; i < int(rest.size()); i++)
+		{
+			Triangle deformed(Displace(rest[i].v0, center, radius), Displace(rest[i].v1, center, radius), Displace(rest[i].v2, center, radius));
+			if (deformed.v0 == triangles[i].v0 && deformed.v1 == triangles[i].v1 && deformed.v2 == triangles[i].v2) continue;
+			triangles[i] = deformed;
+			dirtyBegin = std::min(dirtyBegin, i);
+			dirtyEnd = i + 1;
+		}
+		if (dirtyBegin > dirtyEnd) dirtyBegin = dirtyEnd;
+	}
 };
\ No newline at end of file
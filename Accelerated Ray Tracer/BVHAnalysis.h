@@ -0,0 +1,210 @@
+#pragma once
+#include <cstdio>
+#include <map>
+#include "RayTraceModels.h"
+
+inline float ClippedTriangleArea(const Triangle& tri, const AABB& box)
+{
+	vec3 polygon[9] = { tri.v0, tri.v1, tri.v2 }, clipped[9];
+	int count = 3;
+	for (int plane = 0; plane < 6 && count > 0; plane++)
+	{
+		int axis = plane % 3, clippedCount = 0;
+		float bound = plane < 3 ? box.min[axis] : box.max[axis], sign = plane < 3 ? 1.0f : -1.0f;
+		for (int i = 0; i < count; i++)
+		{
+			const vec3& a = polygon[i]; const vec3& b = polygon[(i + 1) % count];
+			float da = sign * (a[axis] - bound), db = sign * (b[axis] - bound);
+			if (da >= 0.0f) clipped[clippedCount++] = a;
+			if ((da >= 0.0f) != (db >= 0.0f)) clipped[clippedCount++] = a + (b - a) * (da / (da - db));
+		}
+		count = clippedCount;
+		std::copy(clipped, clipped + count, polygon);
+	}
+
+	vec3 area(0.0f);
+	for (int i = 1; i + 1 < count; i++) area += cross(polygon[i] - polygon[0], polygon[i + 1] - polygon[0]);
+	return 0.5f * length(area);
+}
+
+inline bool Overlaps(const AABB& a, const AABB& b)
+{
+	return a.min.x <= b.max.x && b.min.x <= a.max.x && a.min.y <= b.max.y && b.min.y <= a.max.y && a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+struct BVHAnalysis
+{
+public:
+	int nodeCount, leafCount, triangleCount, maxDepth; double averageLeafDepth;
+	float sahCost, epo, siblingOverlapMean, siblingOverlapMax, siblingOverlapTotal;
+	size_t nodeBytes, triangleBytes, primitiveBytes;
+	map<int, int> leafSizes;
+
+	BVHAnalysis(const FlattenedBVHNode* _nodes, int _nodeCount, const Triangle* _triangles, int _triangleCount, const vector<uint>& _primitives, ThreadPool* pool = nullptr)
+		: nodeCount(_nodeCount), leafCount(0), triangleCount(_triangleCount), maxDepth(0), averageLeafDepth(0), sahCost(ComputeSAHCost(_nodes, _nodeCount)), epo(0),
+		siblingOverlapMean(0), siblingOverlapMax(0), siblingOverlapTotal(0), nodeBytes(_nodeCount * sizeof(FlattenedBVHNode)), triangleBytes(_triangleCount * sizeof(Triangle)),
+		primitiveBytes(_primitives.size() * sizeof(uint)), nodes(_nodes), triangles(_triangles), primitives(_primitives),
+		slotCount(_primitives.empty() ? _triangleCount : int(_primitives.size()))
+	{
+		if (nodeCount == 0) return;
+		MeasureTopology();
+		MeasureEPO(pool);
+	}
+
+	void WriteJSON(FILE* file, const string& model, const string& builder, double buildTime) const
+	{
+		fprintf(file, "{\n  \"model\": \"%s\",\n  \"builder\": \"%s\",\n  \"buildMs\": %.3f,\n", EscapeJSON(model).c_str(), builder.c_str(), buildTime * 1000);
+		fprintf(file, "  \"triangles\": %d,\n  \"nodes\": %d,\n  \"leaves\": %d,\n", triangleCount, nodeCount, leafCount);
+		fprintf(file, "  \"memory\": { \"nodeBytes\": %zu, \"triangleBytes\": %zu, \"primitiveBytes\": %zu },\n", nodeBytes, triangleBytes, primitiveBytes);
+		fprintf(file, "  \"sahCost\": %.4f,\n  \"epo\": %.4f,\n", sahCost, epo);
+		fprintf(file, "  \"depth\": { \"max\": %d, \"averageLeaf\": %.3f },\n", maxDepth, averageLeafDepth);
+		fprintf(file, "  \"siblingOverlap\": { \"mean\": %.4f, \"max\": %.4f, \"total\": %.4f },\n", siblingOverlapMean, siblingOverlapMax, siblingOverlapTotal);
+		fprintf(file, "  \"leafSizes\": {");
+		for (auto it = leafSizes.begin(); it != leafSizes.end(); ++it) fprintf(file, "%s \"%d\": %d", it == leafSizes.begin() ? "" : ",", it->first, it->second);
+		fprintf(file, " }\n}\n");
+	}
+
+	float BruteForceEPO(ThreadPool* pool = nullptr) const
+	{
+		if (nodeCount == 0) return 0.0f;
+		double totalArea = 0;
+		for (int t = 0; t < triangleCount; t++) totalArea += 0.5 * length(cross(triangles[t].v1 - triangles[t].v0, triangles[t].v2 - triangles[t].v0));
+		if (totalArea <= 0) return 0.0f;
+
+		vector<double> foreignArea(nodeCount, 0.0);
+		ParallelFor(pool, 0, nodeCount, 16, [&](int begin, int end) {
+			vector<char> inside; vector<int> stack;
+			for (int index = begin; index < end; index++)
+			{
+				inside.assign(triangleCount, 0);
+				stack.assign(1, index);
+				while (!stack.empty())
+				{
+					const FlattenedBVHNode& node = nodes[stack.back()]; stack.pop_back();
+					if (node.count == 0)
+					{
+						stack.push_back(node.left);
+						stack.push_back(node.right);
+						continue;
+					}
+					for (int t = node.left; t < node.right; t++) inside[Primitive(t)] = 1;
+				}
+
+				AABB box = Box(index);
+				for (int t = 0; t < triangleCount; t++)
+					if (!inside[t]) foreignArea[index] += ClippedTriangleArea(triangles[t], box);
+			}
+		});
+
+		double sum = 0;
+		for (double area : foreignArea) sum += area;
+		return float(sum / totalArea);
+	}
+
+private:
+	const FlattenedBVHNode* nodes; const Triangle* triangles; const vector<uint>& primitives;
+	int slotCount;
+	vector<int> enter, leave, leafOf, firstSlot, nextSlot;
+
+	AABB Box(int node) const { return AABB(nodes[node].aabbMin, nodes[node].aabbMax); }
+
+	int Primitive(int slot) const { return primitives.empty() ? slot : int(primitives[slot]); }
+
+	void MeasureTopology()
+	{
+		enter.assign(nodeCount, 0);
+		leave.assign(nodeCount, 0);
+		leafOf.assign(slotCount, -1);
+		float rootArea = Box(0).SurfaceArea(); double depthSum = 0, overlapSum = 0; int innerCount = 0, order = 0;
+
+		vector<pair<int, int>> stack(1, make_pair(0, 0));
+		while (!stack.empty())
+		{
+			int index = stack.back().first, depth = stack.back().second;
+			if (index < 0) { leave[~index] = order; stack.pop_back(); continue; }
+			stack.back().first = ~index;
+			enter[index] = order++;
+
+			const FlattenedBVHNode& node = nodes[index];
+			if (node.count > 0)
+			{
+				leafCount++;
+				leafSizes[node.count]++;
+				maxDepth = std::max(maxDepth, depth);
+				depthSum += depth;
+				for (int t = node.left; t < node.right; t++) leafOf[t] = index;
+				continue;
+			}
+
+			AABB overlap(glm::max(nodes[node.left].aabbMin, nodes[node.right].aabbMin), glm::min(nodes[node.left].aabbMax, nodes[node.right].aabbMax));
+			float overlapArea = overlap.IsEmpty() ? 0.0f : overlap.SurfaceArea(), parentArea = Box(index).SurfaceArea();
+			float ratio = parentArea > 0.0f ? overlapArea / parentArea : 0.0f;
+			overlapSum += ratio;
+			siblingOverlapMax = std::max(siblingOverlapMax, ratio);
+			innerCount++;
+			siblingOverlapTotal += rootArea > 0.0f ? overlapArea / rootArea : 0.0f;
+
+			stack.push_back(make_pair(node.right, depth + 1));
+			stack.push_back(make_pair(node.left, depth + 1));
+		}
+
+		averageLeafDepth = leafCount ? depthSum / leafCount : 0.0;
+		siblingOverlapMean = innerCount ? float(overlapSum / innerCount) : 0.0f;
+	}
+
+	bool InSubtree(int node, int triangle) const
+	{
+		for (int slot = firstSlot[triangle]; slot != -1; slot = nextSlot[slot])
+			if (leafOf[slot] != -1 && enter[node] <= enter[leafOf[slot]] && enter[leafOf[slot]] < leave[node]) return true;
+		return false;
+	}
+
+	void MeasureEPO(ThreadPool* pool)
+	{
+		firstSlot.assign(triangleCount, -1);
+		nextSlot.assign(slotCount, -1);
+		for (int slot = slotCount - 1; slot >= 0; slot--)
+		{
+			nextSlot[slot] = firstSlot[Primitive(slot)];
+			firstSlot[Primitive(slot)] = slot;
+		}
+
+		double totalArea = 0;
+		for (int t = 0; t < triangleCount; t++) totalArea += 0.5 * length(cross(triangles[t].v1 - triangles[t].v0, triangles[t].v2 - triangles[t].v0));
+		if (totalArea <= 0) return;
+
+		vector<double> foreignArea(nodeCount, 0.0);
+		ParallelFor(pool, 0, nodeCount, 16, [&](int begin, int end) {
+			vector<int> stack, overlapping;
+			for (int index = begin; index < end; index++)
+			{
+				AABB box = Box(index);
+				stack.assign(1, 0);
+				overlapping.clear();
+				while (!stack.empty())
+				{
+					int other = stack.back(); stack.pop_back();
+					if (other == index || !Overlaps(box, Box(other))) continue;
+
+					const FlattenedBVHNode& node = nodes[other];
+					if (node.count == 0)
+					{
+						stack.push_back(node.right);
+						stack.push_back(node.left);
+						continue;
+					}
+					for (int t = node.left; t < node.right; t++) overlapping.push_back(Primitive(t));
+				}
+
+				std::sort(overlapping.begin(), overlapping.end());
+				overlapping.erase(std::unique(overlapping.begin(), overlapping.end()), overlapping.end());
+				for (int t : overlapping)
+					if (!InSubtree(index, t)) foreignArea[index] += ClippedTriangleArea(triangles[t], box);
+			}
+		});
+
+		double sum = 0;
+		for (double area : foreignArea) sum += area;
+		epo = float(sum / totalArea);
+	}
+};
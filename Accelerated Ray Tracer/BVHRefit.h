@@ -0,0 +1,75 @@
+#pragma once
+#include "RayTraceModels.h"
+
+struct BVHRefitter
+{
+public:
+	int dirtyBegin, dirtyEnd; float initialSAH, currentSAH;
+
+	BVHRefitter(vector<FlattenedBVHNode>& _nodes) : dirtyBegin(0), dirtyEnd(0), nodes(_nodes), changed(_nodes.size(), 0)
+	{
+		initialSAH = currentSAH = ComputeSAHCost(nodes.data(), int(nodes.size()));
+		if (nodes.empty()) return;
+
+		levels.push_back(vector<int>(1, 0));
+		for (size_t level = 0; level < levels.size(); level++)
+		{
+			vector<int> next;
+			for (int index : levels[level])
+				if (nodes[index].count == 0)
+				{
+					next.push_back(nodes[index].left);
+					next.push_back(nodes[index].right);
+				}
+			if (!next.empty()) levels.push_back(next);
+		}
+	}
+
+	void Refit(const vector<Triangle>& triangles, const vector<uint>& primitives, ThreadPool* pool = nullptr)
+	{
+		for (int level = int(levels.size()) - 1; level >= 0; level--)
+		{
+			const vector<int>& indices = levels[level];
+			ParallelFor(pool, 0, int(indices.size()), parallelLoopGrain, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
+				{
+					FlattenedBVHNode& node = nodes[indices[i]];
+					AABB box;
+					if (node.count > 0)
+						for (int t = node.left; t < node.right; t++)
+						{
+							const Triangle& tri = triangles[primitives.empty() ? t : primitives[t]];
+							box.Expand(tri.v0);
+							box.Expand(tri.v1);
+							box.Expand(tri.v2);
+						}
+					else
+					{
+						box = AABB(nodes[node.left].aabbMin, nodes[node.left].aabbMax);
+						box.Expand(AABB(nodes[node.right].aabbMin, nodes[node.right].aabbMax));
+					}
+
+					changed[indices[i]] = box.min != node.aabbMin || box.max != node.aabbMax;
+					node.aabbMin = box.min;
+					node.aabbMax = box.max;
+				}
+			});
+		}
+
+		int n = int(nodes.size());
+		dirtyBegin = 0;
+		dirtyEnd = n;
+		while (dirtyBegin < n && !changed[dirtyBegin]) dirtyBegin++;
+		while (dirtyEnd > dirtyBegin && !changed[dirtyEnd - 1]) dirtyEnd--;
+		currentSAH = ComputeSAHCost(nodes.data(), n);
+	}
+
+	float Degradation() const { return initialSAH > 0.0f ? currentSAH / initialSAH : 1.0f; }
+
+	bool RebuildRecommended(float threshold = 1.25f) const { return Degradation() > threshold; }
+
+private:
+	vector<FlattenedBVHNode>& nodes;
+	vector<vector<int>> levels;
+	vector<char> changed;
+};
\ No newline at end of file
@@ -0,0 +1,216 @@
+#pragma once
+#include <cstdio>
+#include <map>
+#include "AcceleratedRayTracer.h"
+#include "CPURayTracer.h"
+
+struct BenchmarkResult
+{
+public:
+	string model, builder, pose; int triangles, nodes;
+	double loadMs, buildMs, serializeMs, mraysPerSecond, nodeVisits;
+};
+
+struct BenchmarkMetric
+{
+	const char* name; double BenchmarkResult::* value; bool higherIsBetter; double noise;
+};
+
+struct BenchmarkPose
+{
+	const char* name; vec3 direction; float distance;
+};
+
+const char* benchmarkModels[] = { "Quad.obj", "Bunny_Low.obj", "Bunny.obj", "Bunny_High.obj" };
+const BenchmarkPose benchmarkPoses[] = { { "front", vec3(0.0f, 0.0f, 1.0f), 1.0f }, { "side", vec3(1.0f, 0.0f, 0.0f), 1.0f }, { "top", vec3(0.0f, 1.0f, 0.3f), 1.0f }, { "close", vec3(0.3f, 0.2f, 1.0f), 0.5f } };
+const BenchmarkMetric benchmarkMetrics[] = { { "loadMs", &BenchmarkResult::loadMs, false, 0.05 }, { "buildMs", &BenchmarkResult::buildMs, false, 0.05 },
+	{ "serializeMs", &BenchmarkResult::serializeMs, false, 0.05 }, { "mraysPerSecond", &BenchmarkResult::mraysPerSecond, true, 0.0 }, { "nodeVisits", &BenchmarkResult::nodeVisits, false, 0.001 } };
+
+struct BenchmarkSuite
+{
+public:
+	vector<BenchmarkResult> results;
+
+	bool Run(const Options& options, int width, int height)
+	{
+		ThreadPool pool(options.buildThreads);
+		ThreadPool* buildPool = options.buildThreads == 1 ? nullptr : &pool;
+		int runs = std::max(1, options.benchmarkRuns);
+
+		printf("%-16s %-7s %-6s %9s %9s %9s %9s %9s\n", "Model", "Builder", "Pose", "Load ms", "Build ms", "Flatten", "Mrays/s", "Visits");
+		for (const char* path : benchmarkModels)
+		{
+			Model source; double loadTime = 1e30;
+			for (int run = 0; run < runs; run++)
+			{
+				Model loaded;
+				auto loadStart = std::chrono::high_resolution_clock::now();
+				if (!loaded.LoadModel(path, buildPool))
+				{
+					cerr << "Failed to load model " << path << endl;
+					return false;
+				}
+				loadTime = std::min(loadTime, SecondsSince(loadStart));
+				if (run == 0) source = loaded;
+			}
+
+			for (const char* builder : builderNames)
+			{
+				Options buildOptions = options;
+				buildOptions.builder = builder;
+				Model model; vector<FlattenedBVHNode> bvh; double buildTime = 1e30, serializeTime = 1e30;
+				for (int run = 0; run < runs; run++)
+				{
+					model = source;
+					BuildStats stats;
+					auto buildStart = std::chrono::high_resolution_clock::now();
+					if (!BuildScene(model, buildOptions, bvh, buildPool, &stats)) return false;
+					buildTime = std::min(buildTime, SecondsSince(buildStart) - stats.serializeTime);
+					serializeTime = std::min(serializeTime, stats.serializeTime);
+				}
+
+				CPURayTracer tracer(model.triangles.data(), model.primitives.empty() ? nullptr : model.primitives.data(), bvh.data(), width, height, options.layout == "dfs");
+				tracer.ordered = options.traversal == "ordered";
+				vec3 center = (bvh[0].aabbMin + bvh[0].aabbMax) * 0.5f;
+				float radius = 0.5f * length(bvh[0].aabbMax - bvh[0].aabbMin);
+
+				for (const BenchmarkPose& pose : benchmarkPoses)
+				{
+					Camera camera(center + normalize(pose.direction) * pose.distance * radius, center, vec3(0.0f, 1.0f, 0.0f));
+					vector<vec3> imageData; double renderTime = 1e30;
+					for (int run = 0; run < runs; run++) renderTime = std::min(renderTime, tracer.Render(camera, imageData, options.threads));
+
+					vector<TraversalStats> stats;
+					tracer.MeasureTraversal(camera, stats, buildPool);
+					double visits = 0;
+					for (const TraversalStats& pixel : stats) visits += pixel.counts[innerVisitsChannel] + pixel.counts[leafVisitsChannel];
+
+					BenchmarkResult result = { path, builder, pose.name, int(model.triangles.size()), int(bvh.size()),
+						loadTime * 1000, buildTime * 1000, serializeTime * 1000, width * height / renderTime / 1e6, visits / (width * height) };
+					printf("%-16s %-7s %-6s %9.2f %9.2f %9.2f %9.2f %9.2f\n", path, builder, pose.name, result.loadMs, result.buildMs, result.serializeMs, result.mraysPerSecond, result.nodeVisits);
+					results.push_back(result);
+				}
+			}
+		}
+		return true;
+	}
+
+	bool Write(const string& path) const
+	{
+		ofstream file(path, ios::trunc);
+		if (!file) return false;
+
+		bool csv = IsCSV(path);
+		char line[512];
+		if (csv)
+		{
+			file << "model,builder,pose,triangles,nodes";
+			for (const BenchmarkMetric& metric : benchmarkMetrics) file << "," << metric.name;
+			file << "\n";
+		}
+		else file << "{\n  \"results\": [\n";
+
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const BenchmarkResult& result = results[i];
+			if (csv) snprintf(line, sizeof(line), "%s,%s,%s,%d,%d", result.model.c_str(), result.builder.c_str(), result.pose.c_str(), result.triangles, result.nodes);
+			else snprintf(line, sizeof(line), "    { \"model\": \"%s\", \"builder\": \"%s\", \"pose\": \"%s\", \"triangles\": %d, \"nodes\": %d", result.model.c_str(), result.builder.c_str(), result.pose.c_str(), result.triangles, result.nodes);
+			file << line;
+			for (const BenchmarkMetric& metric : benchmarkMetrics)
+			{
+				if (csv) snprintf(line, sizeof(line), ",%.4f", result.*metric.value);
+				else snprintf(line, sizeof(line), ", \"%s\": %.4f", metric.name, result.*metric.value);
+				file << line;
+			}
+			file << (csv ? "\n" : i + 1 < results.size() ? " },\n" : " }\n");
+		}
+
+		if (!csv) file << "  ]\n}\n";
+		return bool(file);
+	}
+
+	static bool Read(const string& path, vector<BenchmarkResult>& baseline)
+	{
+		ifstream file(path);
+		if (!file) return false;
+
+		bool csv = IsCSV(path);
+		vector<string> columns; string line;
+		if (csv && getline(file, line)) columns = Split(line);
+		while (getline(file, line))
+		{
+			map<string, string> fields;
+			vector<string> values = csv ? Split(line) : vector<string>();
+			for (size_t i = 0; i < values.size() && i < columns.size(); i++) fields[columns[i]] = values[i];
+			if (!csv)
+			{
+				const char* names[] = { "model", "builder", "pose", "triangles", "nodes" };
+				for (const char* name : names) fields[name] = JSONField(line, name);
+				for (const BenchmarkMetric& metric : benchmarkMetrics) fields[metric.name] = JSONField(line, metric.name);
+			}
+			if (fields["model"].empty()) continue;
+
+			BenchmarkResult result{};
+			result.model = fields["model"];
+			result.builder = fields["builder"];
+			result.pose = fields["pose"];
+			result.triangles = atoi(fields["triangles"].c_str());
+			result.nodes = atoi(fields["nodes"].c_str());
+			for (const BenchmarkMetric& metric : benchmarkMetrics) result.*metric.value = atof(fields[metric.name].c_str());
+			baseline.push_back(result);
+		}
+		return true;
+	}
+
+	int Compare(const vector<BenchmarkResult>& baseline, const string& thresholds) const
+	{
+		map<string, double> limits;
+		double defaultLimit = 0.1;
+		for (const string& entry : Split(thresholds))
+		{
+			size_t equals = entry.find('=');
+			if (equals == string::npos) defaultLimit = atof(entry.c_str());
+			else limits[entry.substr(0, equals)] = atof(entry.substr(equals + 1).c_str());
+		}
+
+		int compared = 0, regressions = 0;
+		for (const BenchmarkResult& result : results)
+			for (const BenchmarkResult& previous : baseline)
+			{
+				if (previous.model != result.model || previous.builder != result.builder || previous.pose != result.pose) continue;
+				compared++;
+				for (const BenchmarkMetric& metric : benchmarkMetrics)
+				{
+					double before = previous.*metric.value, after = result.*metric.value, limit = limits.count(metric.name) ? limits[metric.name] : defaultLimit;
+					double worse = metric.higherIsBetter ? before - after : after - before;
+					if (worse <= metric.noise || worse <= limit * std::abs(before)) continue;
+					printf("REGRESSION %s %s %s %s: %.4f -> %.4f (%+.1f%%, limit %.1f%%)\n", result.model.c_str(), result.builder.c_str(), result.pose.c_str(), metric.name,
+						before, after, before != 0.0 ? 100 * (after - before) / before : 0.0, 100 * limit);
+					regressions++;
+				}
+				break;
+			}
+
+		printf("Compared %d of %d results against the baseline, %d regressions\n", compared, int(results.size()), regressions);
+		return regressions;
+	}
+
+private:
+	static bool IsCSV(const string& path) { return path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0; }
+
+	static string JSONField(const string& line, const string& name)
+	{
+		size_t key = line.find("\"" + name + "\":");
+		if (key == string::npos) return "";
+		size_t value = line.find_first_not_of(" \"", key + name.size() + 3);
+		return value == string::npos ? "" : line.substr(value, line.find_first_of("\",}", value) - value);
+	}
+
+	static vector<string> Split(const string& line)
+	{
+		vector<string> parts; string part;
+		istringstream stream(line);
+		while (getline(stream, part, ',')) parts.push_back(part);
+		return parts;
+	}
+};
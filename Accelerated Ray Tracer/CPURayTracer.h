@@ -0,0 +1,554 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "AcceleratedRayTracer.h"
+#include "WideBVH.h"
+#include "RayPacket.h"
+#include "TwoLevelBVH.h"
+#include "QuantizedBVH.h"
+#include "IndexedGeometry.h"
+#include "TraversalStats.h"
+
+const int traversalStackSize = 64;
+
+struct CPURayTracer
+{
+public:
+	const Triangle* triangles; const uint* primitives; const FlattenedBVHNode* bvhNodes;
+	int width, height, tileSize, packetSize; bool depthFirst, ordered;
+	const WideBVH<4>* wideBVH4; const WideBVH<8>* wideBVH8;
+	const QuantizedBVH<8>* quantized8; const QuantizedBVH<16>* quantized16;
+	const TwoLevelBVH* twoLevel; const IndexedGeometry* indexed;
+
+	CPURayTracer(const Triangle* _triangles, const uint* _primitives, const FlattenedBVHNode* _bvhNodes, int _width, int _height, bool _depthFirst = false, int _tileSize = 32)
+		: triangles(_triangles), primitives(_primitives), bvhNodes(_bvhNodes), width(_width), height(_height), tileSize(_tileSize), packetSize(0), depthFirst(_depthFirst), ordered(false), wideBVH4(nullptr), wideBVH8(nullptr), quantized8(nullptr), quantized16(nullptr), twoLevel(nullptr), indexed(nullptr) {}
+
+	static bool RayTriangleIntersect(const Ray& ray, const Triangle& tri, float& t, vec3& hitPoint)
+	{
+		return RayTriangleIntersect(ray, tri.v0, tri.v1, tri.v2, t, hitPoint);
+	}
+
+	static bool RayTriangleIntersect(const Ray& ray, const vec3& v0, const vec3& v1, const vec3& v2, float& t, vec3& hitPoint)
+	{
+		vec3 edge1 = v1 - v0, edge2 = v2 - v0, h = cross(ray.direction, edge2);
+		float a = dot(edge1, h);
+
+		if (abs(a) < 1e-6f) return false;
+
+		float f = 1.0f / a;
+		vec3 s = ray.origin - v0;
+		float u = f * dot(s, h);
+		if (u < 0.0f || u > 1.0f) return false;
+
+		vec3 q = cross(s, edge1);
+		float v = f * dot(ray.direction, q);
+		if (v < 0.0f || u + v > 1.0f) return false;
+
+		t = f * dot(edge2, q);
+		if (t > 1e-6f)
+		{
+			hitPoint = ray.origin + t * ray.direction;
+			return true;
+		}
+
+		return false;
+	}
+
+	static bool RayAABBIntersect(const Ray& ray, const vec3& invDir, const vec3& aabbMin, const vec3& aabbMax)
+	{
+		vec3 t0s = (aabbMin - ray.origin) * invDir;
+		vec3 t1s = (aabbMax - ray.origin) * invDir;
+
+		vec3 tMinVec = min(t0s, t1s);
+		vec3 tMaxVec = max(t0s, t1s);
+
+		float tMin = std::max(std::max(tMinVec.x, tMinVec.y), tMinVec.z),
+			tMax = std::min(std::min(tMaxVec.x, tMaxVec.y), tMaxVec.z);
+
+		return tMax > std::max(tMin, 0.0f);
+	}
+
+	static float RayAABBNear(const Ray& ray, const vec3& invDir, const vec3& aabbMin, const vec3& aabbMax)
+	{
+		vec3 t0s = (aabbMin - ray.origin) * invDir;
+		vec3 t1s = (aabbMax - ray.origin) * invDir;
+
+		vec3 tMinVec = min(t0s, t1s);
+		vec3 tMaxVec = max(t0s, t1s);
+
+		float tMin = std::max(std::max(tMinVec.x, tMinVec.y), tMinVec.z),
+			tMax = std::min(std::min(tMaxVec.x, tMaxVec.y), tMaxVec.z);
+
+		return tMax > std::max(tMin, 0.0f) ? std::max(tMin, 0.0f) : FLT_MAX;
+	}
+
+	vec3 Shade(const Ray& ray, int hitTriangle, const vec3& hitPoint) const
+	{
+		return hitTriangle != -1 ? ShadeSurface(TriangleNormal(hitTriangle), hitPoint) : ShadeSky(ray);
+	}
+
+	vec3 TriangleNormal(int triangle) const
+	{
+		return indexed ? indexed->Normal(triangle) : triangles[triangle].n;
+	}
+
+	static vec3 ShadeSky(const Ray& ray)
+	{
+		float t = (ray.direction.y + 1.0f) * 0.5f;
+		return (1.0f - t) * vec3(1.0f, 1.0f, 1.0f) + t * vec3(0.5f, 0.7f, 1.0f);
+	}
+
+	static vec3 ShadeSurface(const vec3& normal, const vec3& hitPoint)
+	{
+		vec3 lightPos = vec3(10.0f, 10.0f, 10.0f);
+		vec3 lightDir = normalize(lightPos - hitPoint);
+		float diff = std::max(dot(normal, lightDir), 0.0f);
+		return vec3(0.8f) * diff;
+	}
+
+	static void Count(TraversalStats* stats, int channel, int amount = 1)
+	{
+		if (stats) stats->counts[channel] += amount;
+	}
+
+	static void CountDepth(TraversalStats* stats, int depth)
+	{
+		if (stats) stats->counts[stackDepthChannel] = std::max(stats->counts[stackDepthChannel], depth);
+	}
+
+	static void CountLanes(TraversalStats* stats, int mask, int channel)
+	{
+		if (!stats) return;
+		for (int lane = 0; mask >> lane; lane++)
+			if (mask >> lane & 1) stats[lane].counts[channel]++;
+	}
+
+	void IntersectLeaf(const Ray& ray, const FlattenedBVHNode& node, float& closestT, vec3& closestPoint, int& closestTriangle, TraversalStats* stats = nullptr) const
+	{
+		Count(stats, leafVisitsChannel);
+		IntersectTriangles(ray, node.left, node.right, closestT, closestPoint, closestTriangle, stats);
+	}
+
+	int Primitive(int slot) const
+	{
+		return primitives ? int(primitives[slot]) : slot;
+	}
+
+	bool IntersectTriangle(const Ray& ray, int i, float& t, vec3& hitPoint) const
+	{
+		if (!indexed) return RayTriangleIntersect(ray, triangles[i], t, hitPoint);
+		const uvec3& face = indexed->indices[i];
+		return RayTriangleIntersect(ray, indexed->vertices[face.x], indexed->vertices[face.y], indexed->vertices[face.z], t, hitPoint);
+	}
+
+	void IntersectTriangles(const Ray& ray, int first, int end, float& closestT, vec3& closestPoint, int& closestTriangle, TraversalStats* stats = nullptr) const
+	{
+		for (int i = first; i < end; i++)
+		{
+			float t; vec3 hitPoint; int triangle = Primitive(i);
+			Count(stats, triangleTestsChannel);
+			if (!IntersectTriangle(ray, triangle, t, hitPoint)) continue;
+			Count(stats, triangleHitsChannel);
+			if (t < closestT)
+			{
+				closestT = t; closestPoint = hitPoint; closestTriangle = triangle;
+			}
+		}
+	}
+
+	vec3 RayTraceBVHStackless(const Ray& ray, TraversalStats* stats = nullptr) const
+	{
+		float closestT = 1e20f; vec3 closestPoint; int closestTriangle = -1;
+		vec3 invDir = 1.0f / ray.direction;
+
+		for (int index = 0; index != -1;)
+		{
+			const FlattenedBVHNode& node = bvhNodes[index];
+			if (!RayAABBIntersect(ray, invDir, node.aabbMin, node.aabbMax))
+			{
+				index = node.skip;
+				continue;
+			}
+
+			Count(stats, aabbHitsChannel);
+			if (node.count == 0)
+			{
+				Count(stats, innerVisitsChannel);
+				index++;
+			}
+			else
+			{
+				IntersectLeaf(ray, node, closestT, closestPoint, closestTriangle, stats);
+				index = node.skip;
+			}
+		}
+
+		return Shade(ray, closestTriangle, closestPoint);
+	}
+
+	vec3 RayTraceBVHOrdered(const Ray& ray, TraversalStats* stats = nullptr) const
+	{
+		float closestT = 1e20f; vec3 closestPoint; int closestTriangle = -1;
+		vec3 invDir = 1.0f / ray.direction;
+
+		if (RayAABBNear(ray, invDir, bvhNodes[0].aabbMin, bvhNodes[0].aabbMax) >= closestT) return Shade(ray, -1, closestPoint);
+
+		Count(stats, aabbHitsChannel);
+		TraverseOrdered(ray, invDir, 0, closestT, closestPoint, closestTriangle, stats);
+		return Shade(ray, closestTriangle, closestPoint);
+	}
+
+	void TraverseOrdered(const Ray& ray, const vec3& invDir, int root, float& closestT, vec3& closestPoint, int& closestTriangle, TraversalStats* stats = nullptr) const
+	{
+		int stack[traversalStackSize], top = 0; float stackT[traversalStackSize];
+		for (int index = root; index != -1;)
+		{
+			const FlattenedBVHNode& node = bvhNodes[index];
+			if (node.count == 0)
+			{
+				Count(stats, innerVisitsChannel);
+				int nearChild = node.left, farChild = node.right;
+				float tNear = RayAABBNear(ray, invDir, bvhNodes[nearChild].aabbMin, bvhNodes[nearChild].aabbMax);
+				float tFar = RayAABBNear(ray, invDir, bvhNodes[farChild].aabbMin, bvhNodes[farChild].aabbMax);
+				if (tFar < tNear)
+				{
+					std::swap(nearChild, farChild);
+					std::swap(tNear, tFar);
+				}
+
+				if (tNear < closestT)
+				{
+					Count(stats, aabbHitsChannel);
+					if (tFar < closestT && top < traversalStackSize)
+					{
+						Count(stats, aabbHitsChannel);
+						stack[top] = farChild;
+						stackT[top++] = tFar;
+						CountDepth(stats, top);
+					}
+					index = nearChild;
+					continue;
+				}
+			}
+			else IntersectLeaf(ray, node, closestT, closestPoint, closestTriangle, stats);
+
+			index = -1;
+			while (top > 0 && index == -1)
+				if (stackT[--top] < closestT) index = stack[top];
+		}
+	}
+
+	template<int K>
+	void RayTracePacket(RayPacket<K>& packet, vec3* hitPoints, int* hitTriangles, TraversalStats* stats = nullptr) const
+	{
+		for (int lane = 0; lane < K; lane++) hitTriangles[lane] = -1;
+
+		struct Entry { int node, mask; } stack[traversalStackSize];
+		int top = 0;
+		stack[top++] = { 0, packet.active };
+
+		while (top > 0)
+		{
+			Entry entry = stack[--top];
+			const FlattenedBVHNode& node = bvhNodes[entry.node];
+			int mask = PacketIntersectAABB(packet, node.aabbMin, node.aabbMax) & entry.mask;
+			if (!mask) continue;
+			CountLanes(stats, mask, aabbHitsChannel);
+
+			if (PopCount(mask) <= packetDivergenceLanes)
+			{
+				for (int lane = 0; lane < K; lane++)
+					if (mask >> lane & 1)
+					{
+						vec3 invDir(packet.invDir[0][lane], packet.invDir[1][lane], packet.invDir[2][lane]);
+						TraverseOrdered(packet.rays[lane], invDir, entry.node, packet.closestT[lane], hitPoints[lane], hitTriangles[lane], stats ? stats + lane : nullptr);
+					}
+			}
+			else if (node.count > 0)
+			{
+				for (int lane = 0; lane < K; lane++)
+					if (mask >> lane & 1) IntersectLeaf(packet.rays[lane], node, packet.closestT[lane], hitPoints[lane], hitTriangles[lane], stats ? stats + lane : nullptr);
+			}
+			else if (top + 2 <= traversalStackSize)
+			{
+				CountLanes(stats, mask, innerVisitsChannel);
+				const FlattenedBVHNode& left = bvhNodes[node.left];
+				const FlattenedBVHNode& right = bvhNodes[node.right];
+				vec3 gap = (right.aabbMin + right.aabbMax) - (left.aabbMin + left.aabbMax);
+				int axis = abs(gap.x) > abs(gap.y) ? (abs(gap.x) > abs(gap.z) ? 0 : 2) : (abs(gap.y) > abs(gap.z) ? 1 : 2);
+
+				int lane = 0;
+				while (!(mask >> lane & 1)) lane++;
+				bool rightFirst = packet.rays[lane].direction[axis] * gap[axis] < 0.0f;
+				stack[top++] = { rightFirst ? node.left : node.right, mask };
+				stack[top++] = { rightFirst ? node.right : node.left, mask };
+				for (int lane = 0; stats && lane < K; lane++)
+					if (mask >> lane & 1) CountDepth(stats + lane, top);
+			}
+		}
+	}
+
+	template<int N>
+	vec3 RayTraceWideBVH(const WideBVH<N>& bvh, const Ray& ray, TraversalStats* stats = nullptr) const
+	{
+		float closestT = 1e20f; vec3 closestPoint; int closestTriangle = -1;
+		vec3 invDir = 1.0f / ray.direction;
+
+		struct Entry { int node; float t; } stack[4 * traversalStackSize];
+		int top = 0;
+		stack[top++] = { 0, 0.0f };
+
+		while (top > 0)
+		{
+			Entry entry = stack[--top];
+			if (entry.t >= closestT) continue;
+
+			const WideBVHNode<N>& node = bvh.nodes[entry.node];
+			float tEntry[N]; int order[N], hits = 0;
+			int mask = IntersectChildren(node, ray.origin, invDir, closestT, tEntry);
+			Count(stats, innerVisitsChannel);
+			Count(stats, aabbHitsChannel, PopCount(mask));
+			for (int i = 0; i < N; i++)
+			{
+				if (!(mask >> i & 1)) continue;
+				int j = hits++;
+				for (; j > 0 && tEntry[order[j - 1]] > tEntry[i]; j--) order[j] = order[j - 1];
+				order[j] = i;
+			}
+
+			for (int i = 0; i < hits; i++)
+				if (node.count[order[i]] > 0 && tEntry[order[i]] < closestT)
+				{
+					Count(stats, leafVisitsChannel);
+					IntersectTriangles(ray, node.child[order[i]], node.child[order[i]] + node.count[order[i]], closestT, closestPoint, closestTriangle, stats);
+				}
+			for (int i = hits - 1; i >= 0; i--)
+				if (node.count[order[i]] == 0 && top < 4 * traversalStackSize) stack[top++] = { node.child[order[i]], tEntry[order[i]] };
+			CountDepth(stats, top);
+		}
+
+		return Shade(ray, closestTriangle, closestPoint);
+	}
+
+	template<int Bits>
+	vec3 RayTraceQuantized(const QuantizedBVH<Bits>& bvh, const Ray& ray, TraversalStats* stats = nullptr) const
+	{
+		float closestT = 1e20f; vec3 closestPoint; int closestTriangle = -1;
+		vec3 invDir = 1.0f / ray.direction;
+
+		int stack[traversalStackSize], stackCount[traversalStackSize], top = 0; float stackT[traversalStackSize];
+		for (int index = 0, count = 0; index != -1;)
+		{
+			if (count > 0)
+			{
+				Count(stats, leafVisitsChannel);
+				IntersectTriangles(ray, index, index + count, closestT, closestPoint, closestTriangle, stats);
+			}
+			else
+			{
+				Count(stats, innerVisitsChannel);
+				const QuantizedBVHNode<Bits>& node = bvh.nodes[index];
+				float tChild[2];
+				node.IntersectChildren(ray.origin, invDir, tChild);
+
+				int nearChild = tChild[1] < tChild[0], farChild = nearChild ^ 1;
+				if (tChild[nearChild] < closestT)
+				{
+					Count(stats, aabbHitsChannel);
+					if (tChild[farChild] < closestT && top < traversalStackSize)
+					{
+						Count(stats, aabbHitsChannel);
+						stack[top] = node.link[farChild];
+						stackCount[top] = node.count[farChild];
+						stackT[top++] = tChild[farChild];
+						CountDepth(stats, top);
+					}
+					index = node.link[nearChild];
+					count = node.count[nearChild];
+					continue;
+				}
+			}
+
+			index = -1;
+			while (top > 0 && index == -1)
+				if (stackT[--top] < closestT)
+				{
+					index = stack[top];
+					count = stackCount[top];
+				}
+		}
+
+		return Shade(ray, closestTriangle, closestPoint);
+	}
+
+	vec3 RayTraceInstances(const Ray& ray, TraversalStats* stats = nullptr) const
+	{
+		float closestT = 1e20f; vec3 closestPoint; int closestTriangle = -1; const Instance* closestInstance = nullptr;
+		vec3 invDir = 1.0f / ray.direction;
+		const vector<FlattenedBVHNode>& tlasNodes = twoLevel->tlasNodes;
+		if (tlasNodes.empty()) return ShadeSky(ray);
+
+		int stack[traversalStackSize], top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const FlattenedBVHNode& node = tlasNodes[stack[--top]];
+			if (RayAABBNear(ray, invDir, node.aabbMin, node.aabbMax) >= closestT) continue;
+
+			Count(stats, aabbHitsChannel);
+			if (node.count == 0)
+			{
+				Count(stats, innerVisitsChannel);
+				if (top + 2 > traversalStackSize) continue;
+				stack[top++] = node.right;
+				stack[top++] = node.left;
+				CountDepth(stats, top);
+				continue;
+			}
+
+			Count(stats, leafVisitsChannel);
+			for (int i = node.left; i < node.right; i++)
+			{
+				const Instance& instance = twoLevel->instances[i];
+				Ray local;
+				local.origin = TwoLevelBVH::ToObject(instance, ray.origin, 1.0f);
+				local.direction = TwoLevelBVH::ToObject(instance, ray.direction, 0.0f);
+				vec3 localInvDir = 1.0f / local.direction;
+
+				const FlattenedBVHNode& root = bvhNodes[instance.blasRoot];
+				if (RayAABBNear(local, localInvDir, root.aabbMin, root.aabbMax) >= closestT) continue;
+
+				Count(stats, aabbHitsChannel);
+				float previousT = closestT;
+				TraverseOrdered(local, localInvDir, instance.blasRoot, closestT, closestPoint, closestTriangle, stats);
+				if (closestT < previousT) closestInstance = &instance;
+			}
+		}
+
+		if (closestTriangle == -1) return ShadeSky(ray);
+		return ShadeSurface(TwoLevelBVH::NormalToWorld(*closestInstance, TriangleNormal(closestTriangle)), ray.origin + closestT * ray.direction);
+	}
+
+	vec3 RayTraceBVH(const Ray& ray, TraversalStats* stats = nullptr) const
+	{
+		if (twoLevel) return RayTraceInstances(ray, stats);
+		if (quantized16) return RayTraceQuantized(*quantized16, ray, stats);
+		if (quantized8) return RayTraceQuantized(*quantized8, ray, stats);
+		if (wideBVH8) return RayTraceWideBVH(*wideBVH8, ray, stats);
+		if (wideBVH4) return RayTraceWideBVH(*wideBVH4, ray, stats);
+		if (ordered) return RayTraceBVHOrdered(ray, stats);
+		if (depthFirst) return RayTraceBVHStackless(ray, stats);
+
+		float closestT = 1e20f; vec3 closestPoint; int closestTriangle = -1;
+		vec3 invDir = 1.0f / ray.direction;
+
+		int stack[traversalStackSize], top = 0;
+		stack[top++] = 0;
+
+		while (top > 0)
+		{
+			const FlattenedBVHNode& node = bvhNodes[stack[--top]];
+			if (!RayAABBIntersect(ray, invDir, node.aabbMin, node.aabbMax)) continue;
+
+			Count(stats, aabbHitsChannel);
+			if (node.count == 0)
+			{
+				Count(stats, innerVisitsChannel);
+				if (top + 2 > traversalStackSize) continue;
+				stack[top++] = node.right;
+				stack[top++] = node.left;
+				CountDepth(stats, top);
+			}
+			else IntersectLeaf(ray, node, closestT, closestPoint, closestTriangle, stats);
+		}
+
+		return Shade(ray, closestTriangle, closestPoint);
+	}
+
+	Ray GenerateRay(const Camera& camera, int x, int y) const
+	{
+		float u = (x + 0.5f) / width, v = 1.0f - (y + 0.5f) / height;
+		return Ray(camera.position, camera.forward + 4 * (u - 0.5f) * camera.right + 3 * (v - 0.5f) * camera.up);
+	}
+
+	template<int K>
+	void RenderTilePackets(const Camera& camera, vector<vec3>& imageData, int x0, int y0, int x1, int y1, TraversalStats* stats) const
+	{
+		const int packetWidth = 4, packetHeight = K / packetWidth;
+		RayPacket<K> packet; vec3 hitPoints[K]; int hitTriangles[K]; TraversalStats laneStats[K];
+
+		for (int py = y0; py < y1; py += packetHeight)
+			for (int px = x0; px < x1; px += packetWidth)
+			{
+				packet.Clear();
+				for (int lane = 0; lane < K; lane++)
+				{
+					int x = px + lane % packetWidth, y = py + lane / packetWidth;
+					if (x < x1 && y < y1) packet.SetRay(lane, GenerateRay(camera, x, y));
+				}
+
+				if (stats) std::fill(laneStats, laneStats + K, TraversalStats());
+				RayTracePacket(packet, hitPoints, hitTriangles, stats ? laneStats : nullptr);
+				for (int lane = 0; lane < K; lane++)
+					if (packet.active >> lane & 1)
+					{
+						int x = px + lane % packetWidth, y = py + lane / packetWidth;
+						imageData[y * width + x] = Shade(packet.rays[lane], hitTriangles[lane], hitPoints[lane]);
+						if (stats) stats[y * width + x] = laneStats[lane];
+					}
+			}
+	}
+
+	void RenderTile(const Camera& camera, vector<vec3>& imageData, int tile, TraversalStats* stats = nullptr) const
+	{
+		int tilesX = (width + tileSize - 1) / tileSize;
+		int x0 = tile % tilesX * tileSize, y0 = tile / tilesX * tileSize;
+		int x1 = std::min(x0 + tileSize, width), y1 = std::min(y0 + tileSize, height);
+
+		bool packets = !twoLevel && !quantized8 && !quantized16;
+		if (packetSize == 16 && packets) return RenderTilePackets<16>(camera, imageData, x0, y0, x1, y1, stats);
+		if (packetSize == 8 && packets) return RenderTilePackets<8>(camera, imageData, x0, y0, x1, y1, stats);
+
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++)
+				imageData[y * width + x] = RayTraceBVH(GenerateRay(camera, x, y), stats ? stats + y * width + x : nullptr);
+	}
+
+	int TileCount() const
+	{
+		return ((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize);
+	}
+
+	double Render(const Camera& camera, vector<vec3>& imageData, int threadCount = 0) const
+	{
+		if (threadCount <= 0) threadCount = std::max(1u, std::thread::hardware_concurrency());
+		imageData.resize(width * height);
+
+		int tileCount = TileCount();
+		std::atomic<int> nextTile(0);
+
+		TraceSpan trace("Render");
+		auto start = std::chrono::high_resolution_clock::now();
+		vector<std::thread> workers;
+		for (int i = 0; i < threadCount; i++)
+			workers.emplace_back([&]() {
+				TraceSpan workerTrace("RenderTiles");
+				for (int tile = nextTile++; tile < tileCount; tile = nextTile++)
+					RenderTile(camera, imageData, tile);
+			});
+		for (auto& worker : workers) worker.join();
+		auto end = std::chrono::high_resolution_clock::now();
+
+		return std::chrono::duration<double>(end - start).count();
+	}
+
+	void MeasureTraversal(const Camera& camera, vector<TraversalStats>& stats, ThreadPool* pool = nullptr) const
+	{
+		stats.assign(width * height, TraversalStats());
+		vector<vec3> imageData(width * height);
+		ParallelFor(pool, 0, TileCount(), 1, [&](int begin, int end) {
+			for (int tile = begin; tile < end; tile++) RenderTile(camera, imageData, tile, stats.data());
+		});
+	}
+};
\ No newline at end of file
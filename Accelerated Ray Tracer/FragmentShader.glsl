@@ -1,148 +1,499 @@
-﻿#version 430 core
-#extension GL_NV_uniform_buffer_std430_layout: enable
-
-in vec2 screenCoord;
-out vec4 FragColor;
-
-struct Ray { vec3 origin, direction; };
-struct Camera { vec3 position, forward, right, up; };
-struct Triangle { vec3 v0, v1, v2, n; };
-struct FlattenedKDNode { int left, right, count, tri, tri1, tri2, tri3; vec3 aabbMin, aabbMax; };
-struct FlattenedBVHNode { int left, right, count; vec3 aabbMin, aabbMax; };
-
-uniform Camera camera;
-uniform int triangleCount, bvhCount;
-layout(std430, binding = 0) buffer TriangleBlock{ Triangle triangles[]; };
-layout(std430, binding = 1) buffer BVHBlock{ FlattenedBVHNode bvhNodes[];};
-layout(std430, binding = 2) buffer AABBIntersectionBuffer { int aabbCollisionCounts[]; };
-
-Ray CreateRay(vec3 o, vec3 d)
-{
-    Ray ray;
-    ray.origin = o;
-    ray.direction = normalize(d);
-    return ray;
-}
-
-bool RayTriangleIntersect(Ray ray, Triangle tri, out float t, out vec3 hitPoint)
-{
-    vec3 edge1 = tri.v1 - tri.v0, edge2 = tri.v2 - tri.v0, h = cross(ray.direction, edge2);
-    float a = dot(edge1, h);
-
-    if (abs(a) < 1e-6) return false;
-
-    float f = 1.0 / a;
-    vec3 s = ray.origin - tri.v0;
-    float u = f * dot(s, h);
-    if (u < 0.0 || u > 1.0) return false;
-
-    vec3 q = cross(s, edge1);
-    float v = f * dot(ray.direction, q);
-    if (v < 0.0 || u + v > 1.0) return false;
-
-    t = f * dot(edge2, q);
-    if (t > 1e-6)
-    {
-        hitPoint = ray.origin + t * ray.direction;
-        return true;
-    }
-
-    return false;
-}
-
-vec3 RayTrace(Ray ray)
-{
-    float closestT = 1e20, t = (ray.direction.y + 1.0) * 0.5;
-    vec3 color = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
-
-    for (int i = 0; i < triangleCount; i++)
-    {
-        float t; vec3 hitPoint;
-        if (RayTriangleIntersect(ray, triangles[i], t, hitPoint))
-        {
-            if (t < closestT)
-            {
-                closestT = t;
-                vec3 lightPos = vec3(10.0, 10.0, 10.0);
-                vec3 lightDir = normalize(lightPos - hitPoint);
-                float diff = max(dot(triangles[i].n, lightDir), 0.0);
-                color = vec3(0.8) * diff;
-            }
-        }
-    }
-
-    return color;
-}
-
-bool RayAABBIntersect(Ray ray, vec3 aabbMin, vec3 aabbMax)
-{
-    vec3 invDir = 1.0 / ray.direction;
-    vec3 t0s = (aabbMin - ray.origin) * invDir;
-    vec3 t1s = (aabbMax - ray.origin) * invDir;
-    
-    vec3 tMinVec = min(t0s, t1s);
-    vec3 tMaxVec = max(t0s, t1s);
-    
-    float tMin = max(max(tMinVec.x, tMinVec.y), tMinVec.z),
-    tMax = min(min(tMaxVec.x, tMaxVec.y), tMaxVec.z);
-    
-    return tMax > max(tMin, 0.0);
-}
-
-vec3 RayTraceBVH(Ray ray)
-{
-    float t = (ray.direction.y + 1.0) * 0.5, closestT = 1e20;
-    vec3 color = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
-
-    int queue[1000], l = 0, r = 1; 
-    queue[0] = 0; 
-
-    int rayID = int(gl_FragCoord.y) * 800 + int(gl_FragCoord.x); 
-    aabbCollisionCounts[rayID] = 0; 
-
-    while (l < r)
-    {
-        int cnt = queue[l++];
-        if (!RayAABBIntersect(ray, bvhNodes[cnt].aabbMin, bvhNodes[cnt].aabbMax)) continue;
-
-        aabbCollisionCounts[rayID]++;
-
-        if (bvhNodes[cnt].count == 0)
-        {
-            if (RayAABBIntersect(ray, bvhNodes[bvhNodes[cnt].left].aabbMin, bvhNodes[bvhNodes[cnt].left].aabbMax)) 
-                queue[r++] = bvhNodes[cnt].left;
-            if (RayAABBIntersect(ray, bvhNodes[bvhNodes[cnt].right].aabbMin, bvhNodes[bvhNodes[cnt].right].aabbMax)) 
-                queue[r++] = bvhNodes[cnt].right;
-        }
-        else
-        {
-            for (int i = bvhNodes[cnt].left; i < bvhNodes[cnt].right; i++)
-            {
-                vec3 hitPoint;
-                if (RayTriangleIntersect(ray, triangles[i], t, hitPoint))
-                {
-                    if (t >= closestT) continue;
-                    vec3 lightPos = vec3(10.0, 10.0, 10.0);
-                    vec3 lightDir = normalize(lightPos - hitPoint);
-                    float diff = max(dot(triangles[i].n, lightDir), 0.0);
-                    color = vec3(0.8) * diff; 
-                    closestT = t;
-                }
-            }
-        }
-    }
-
-    return color;
-}
-
-void main()
-{
-    float u = screenCoord.x, v = screenCoord.y;
-
-    Ray ray = CreateRay(camera.position, camera.forward + 4 * (u - 0.5) * camera.right + 3 * (v - 0.5) * camera.up);
-    
-    //FragColor = vec4(1.0, 1.0, 1.0, 1.0);
-    //FragColor = vec4(vec3(bvhNodes[0].left), 1.0);
-    //FragColor = vec4(RayTrace(ray), 1.0);
-    FragColor = vec4(RayTraceBVH(ray), 1.0);
+﻿#version 430 core
+#extension GL_NV_uniform_buffer_std430_layout: enable
+
+in vec2 screenCoord;
+out vec4 FragColor;
+
+struct Ray { vec3 origin, direction; };
+struct Camera { vec3 position, forward, right, up; };
+struct Triangle { vec3 v0, v1, v2, n; };
+struct FlattenedKDNode { int left, right, count, tri, tri1, tri2, tri3; vec3 aabbMin, aabbMax; };
+struct FlattenedBVHNode { int left, right, count, skip; vec3 aabbMin, aabbMax; };
+struct Instance { vec4 worldToObject[3]; int blasRoot, pad0, pad1, pad2; };
+struct TraversalStats { int aabbHits, innerVisits, leafVisits, triangleTests, triangleHits, stackDepth; };
+
+uniform Camera camera;
+uniform int triangleCount, primitiveCount, bvhCount, bvhLayout, bvhTraversal, instanceCount, quantizedBits, indexedGeometry;
+layout(std430, binding = 0) buffer TriangleBlock{ Triangle triangles[]; };
+layout(std430, binding = 1) buffer BVHBlock{ FlattenedBVHNode bvhNodes[];};
+layout(std430, binding = 2) buffer TraversalStatsBuffer { TraversalStats traversalStats[]; };
+layout(std430, binding = 3) buffer TLASBlock{ FlattenedBVHNode tlasNodes[]; };
+layout(std430, binding = 4) buffer InstanceBlock{ Instance instances[]; };
+layout(std430, binding = 5) buffer QuantizedBlock{ uint quantizedNodes[]; };
+layout(std430, binding = 6) buffer VertexBlock{ float vertices[]; };
+layout(std430, binding = 7) buffer IndexBlock{ uint indices[]; };
+layout(std430, binding = 8) buffer PrimitiveBlock{ uint primitives[]; };
+
+TraversalStats rayStats;
+
+Ray CreateRay(vec3 o, vec3 d)
+{
+    Ray ray;
+    ray.origin = o;
+    ray.direction = normalize(d);
+    return ray;
+}
+
+vec3 Vertex(uint index)
+{
+    return vec3(vertices[3u * index], vertices[3u * index + 1u], vertices[3u * index + 2u]);
+}
+
+int LeafTriangle(int i)
+{
+    return primitiveCount == 0 ? i : int(primitives[i]);
+}
+
+Triangle LoadTriangle(int i)
+{
+    if (indexedGeometry == 0) return triangles[i];
+
+    Triangle tri;
+    tri.v0 = Vertex(indices[3 * i]);
+    tri.v1 = Vertex(indices[3 * i + 1]);
+    tri.v2 = Vertex(indices[3 * i + 2]);
+    tri.n = vec3(0.0);
+    return tri;
+}
+
+vec3 TriangleNormal(int i)
+{
+    if (indexedGeometry == 0) return triangles[i].n;
+
+    Triangle tri = LoadTriangle(i);
+    return normalize(cross(tri.v1 - tri.v0, tri.v2 - tri.v0));
+}
+
+bool RayTriangleIntersect(Ray ray, Triangle tri, out float t, out vec3 hitPoint)
+{
+    rayStats.triangleTests++;
+    vec3 edge1 = tri.v1 - tri.v0, edge2 = tri.v2 - tri.v0, h = cross(ray.direction, edge2);
+    float a = dot(edge1, h);
+
+    if (abs(a) < 1e-6) return false;
+
+    float f = 1.0 / a;
+    vec3 s = ray.origin - tri.v0;
+    float u = f * dot(s, h);
+    if (u < 0.0 || u > 1.0) return false;
+
+    vec3 q = cross(s, edge1);
+    float v = f * dot(ray.direction, q);
+    if (v < 0.0 || u + v > 1.0) return false;
+
+    t = f * dot(edge2, q);
+    if (t > 1e-6)
+    {
+        hitPoint = ray.origin + t * ray.direction;
+        rayStats.triangleHits++;
+        return true;
+    }
+
+    return false;
+}
+
+vec3 RayTrace(Ray ray)
+{
+    float closestT = 1e20, t = (ray.direction.y + 1.0) * 0.5;
+    vec3 color = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+
+    for (int i = 0; i < triangleCount; i++)
+    {
+        float t; vec3 hitPoint;
+        if (RayTriangleIntersect(ray, LoadTriangle(i), t, hitPoint))
+        {
+            if (t < closestT)
+            {
+                closestT = t;
+                vec3 lightPos = vec3(10.0, 10.0, 10.0);
+                vec3 lightDir = normalize(lightPos - hitPoint);
+                float diff = max(dot(TriangleNormal(i), lightDir), 0.0);
+                color = vec3(0.8) * diff;
+            }
+        }
+    }
+
+    return color;
+}
+
+bool RayAABBIntersect(Ray ray, vec3 aabbMin, vec3 aabbMax)
+{
+    vec3 invDir = 1.0 / ray.direction;
+    vec3 t0s = (aabbMin - ray.origin) * invDir;
+    vec3 t1s = (aabbMax - ray.origin) * invDir;
+    
+    vec3 tMinVec = min(t0s, t1s);
+    vec3 tMaxVec = max(t0s, t1s);
+    
+    float tMin = max(max(tMinVec.x, tMinVec.y), tMinVec.z),
+    tMax = min(min(tMaxVec.x, tMaxVec.y), tMaxVec.z);
+    
+    return tMax > max(tMin, 0.0);
+}
+
+float RayAABBNear(Ray ray, vec3 invDir, vec3 aabbMin, vec3 aabbMax)
+{
+    vec3 t0s = (aabbMin - ray.origin) * invDir;
+    vec3 t1s = (aabbMax - ray.origin) * invDir;
+    
+    vec3 tMinVec = min(t0s, t1s);
+    vec3 tMaxVec = max(t0s, t1s);
+    
+    float tMin = max(max(tMinVec.x, tMinVec.y), tMinVec.z),
+    tMax = min(min(tMaxVec.x, tMaxVec.y), tMaxVec.z);
+    
+    return tMax > max(tMin, 0.0) ? max(tMin, 0.0) : 1e30;
+}
+
+vec3 RayTraceBVH(Ray ray)
+{
+    float t = (ray.direction.y + 1.0) * 0.5, closestT = 1e20;
+    vec3 color = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+
+    int queue[1000], l = 0, r = 1; 
+    queue[0] = 0; 
+
+    while (l < r)
+    {
+        int cnt = queue[l++];
+        if (!RayAABBIntersect(ray, bvhNodes[cnt].aabbMin, bvhNodes[cnt].aabbMax)) continue;
+
+        rayStats.aabbHits++;
+
+        if (bvhNodes[cnt].count == 0)
+        {
+            rayStats.innerVisits++;
+            if (RayAABBIntersect(ray, bvhNodes[bvhNodes[cnt].left].aabbMin, bvhNodes[bvhNodes[cnt].left].aabbMax)) 
+                queue[r++] = bvhNodes[cnt].left;
+            if (RayAABBIntersect(ray, bvhNodes[bvhNodes[cnt].right].aabbMin, bvhNodes[bvhNodes[cnt].right].aabbMax)) 
+                queue[r++] = bvhNodes[cnt].right;
+            rayStats.stackDepth = max(rayStats.stackDepth, r - l);
+        }
+        else
+        {
+            rayStats.leafVisits++;
+            for (int i = bvhNodes[cnt].left; i < bvhNodes[cnt].right; i++)
+            {
+                vec3 hitPoint; int triangle = LeafTriangle(i);
+                if (RayTriangleIntersect(ray, LoadTriangle(triangle), t, hitPoint))
+                {
+                    if (t >= closestT) continue;
+                    vec3 lightPos = vec3(10.0, 10.0, 10.0);
+                    vec3 lightDir = normalize(lightPos - hitPoint);
+                    float diff = max(dot(TriangleNormal(triangle), lightDir), 0.0);
+                    color = vec3(0.8) * diff; 
+                    closestT = t;
+                }
+            }
+        }
+    }
+
+    return color;
+}
+
+vec3 RayTraceBVHStackless(Ray ray)
+{
+    float t = (ray.direction.y + 1.0) * 0.5, closestT = 1e20;
+    vec3 color = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+
+    int cnt = 0;
+    while (cnt != -1)
+    {
+        if (!RayAABBIntersect(ray, bvhNodes[cnt].aabbMin, bvhNodes[cnt].aabbMax)) 
+        {
+            cnt = bvhNodes[cnt].skip;
+            continue;
+        }
+
+        rayStats.aabbHits++;
+
+        if (bvhNodes[cnt].count == 0)
+        {
+            rayStats.innerVisits++;
+            cnt++;
+        }
+        else
+        {
+            rayStats.leafVisits++;
+            for (int i = bvhNodes[cnt].left; i < bvhNodes[cnt].right; i++)
+            {
+                vec3 hitPoint; int triangle = LeafTriangle(i);
+                if (RayTriangleIntersect(ray, LoadTriangle(triangle), t, hitPoint))
+                {
+                    if (t >= closestT) continue;
+                    vec3 lightPos = vec3(10.0, 10.0, 10.0);
+                    vec3 lightDir = normalize(lightPos - hitPoint);
+                    float diff = max(dot(TriangleNormal(triangle), lightDir), 0.0);
+                    color = vec3(0.8) * diff; 
+                    closestT = t;
+                }
+            }
+            cnt = bvhNodes[cnt].skip;
+        }
+    }
+
+    return color;
+}
+
+vec3 RayTraceBVHOrdered(Ray ray)
+{
+    float t = (ray.direction.y + 1.0) * 0.5, closestT = 1e20;
+    vec3 color = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+    vec3 invDir = 1.0 / ray.direction;
+
+    if (RayAABBNear(ray, invDir, bvhNodes[0].aabbMin, bvhNodes[0].aabbMax) >= closestT) return color;
+    rayStats.aabbHits++;
+
+    int stack[64], top = 0, cnt = 0;
+    float stackT[64];
+
+    while (cnt != -1)
+    {
+        if (bvhNodes[cnt].count == 0)
+        {
+            rayStats.innerVisits++;
+            int nearChild = bvhNodes[cnt].left, farChild = bvhNodes[cnt].right;
+            float tNear = RayAABBNear(ray, invDir, bvhNodes[nearChild].aabbMin, bvhNodes[nearChild].aabbMax);
+            float tFar = RayAABBNear(ray, invDir, bvhNodes[farChild].aabbMin, bvhNodes[farChild].aabbMax);
+            if (tFar < tNear)
+            {
+                int node = nearChild; nearChild = farChild; farChild = node;
+                float tNode = tNear; tNear = tFar; tFar = tNode;
+            }
+
+            if (tNear < closestT)
+            {
+                rayStats.aabbHits++;
+                if (tFar < closestT)
+                {
+                    rayStats.aabbHits++;
+                    stack[top] = farChild; stackT[top++] = tFar;
+                    rayStats.stackDepth = max(rayStats.stackDepth, top);
+                }
+                cnt = nearChild;
+                continue;
+            }
+        }
+        else
+        {
+            rayStats.leafVisits++;
+            for (int i = bvhNodes[cnt].left; i < bvhNodes[cnt].right; i++)
+            {
+                vec3 hitPoint; int triangle = LeafTriangle(i);
+                if (RayTriangleIntersect(ray, LoadTriangle(triangle), t, hitPoint))
+                {
+                    if (t >= closestT) continue;
+                    vec3 lightPos = vec3(10.0, 10.0, 10.0);
+                    vec3 lightDir = normalize(lightPos - hitPoint);
+                    float diff = max(dot(TriangleNormal(triangle), lightDir), 0.0);
+                    color = vec3(0.8) * diff; 
+                    closestT = t;
+                }
+            }
+        }
+
+        cnt = -1;
+        while (top > 0 && cnt == -1)
+        {
+            top--;
+            if (stackT[top] < closestT) cnt = stack[top];
+        }
+    }
+
+    return color;
+}
+
+uint QuantizedCode(int base, int index)
+{
+    int perWord = 32 / quantizedBits;
+    return bitfieldExtract(quantizedNodes[base + 7 + index / perWord], index % perWord * quantizedBits, quantizedBits);
+}
+
+float QuantizedChildNear(Ray ray, vec3 invDir, int base, int child)
+{
+    if (int(quantizedNodes[base + 4 + child]) == -1) return 1e30;
+
+    vec3 origin = uintBitsToFloat(uvec3(quantizedNodes[base], quantizedNodes[base + 1], quantizedNodes[base + 2]));
+    uint exponents = quantizedNodes[base + 3];
+    vec3 scale = uintBitsToFloat(uvec3(bitfieldExtract(exponents, 0, 8), bitfieldExtract(exponents, 8, 8), bitfieldExtract(exponents, 16, 8)) << 23);
+    precise vec3 aabbMin = origin + vec3(QuantizedCode(base, child), QuantizedCode(base, 4 + child), QuantizedCode(base, 8 + child)) * scale;
+    precise vec3 aabbMax = origin + vec3(QuantizedCode(base, 2 + child), QuantizedCode(base, 6 + child), QuantizedCode(base, 10 + child)) * scale;
+    return RayAABBNear(ray, invDir, aabbMin, aabbMax);
+}
+
+vec3 RayTraceQuantized(Ray ray)
+{
+    float t = (ray.direction.y + 1.0) * 0.5, closestT = 1e20;
+    vec3 color = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+    vec3 invDir = 1.0 / ray.direction;
+
+    int stride = 7 + 3 * quantizedBits / 8, stack[64], stackCount[64], top = 0, hitTriangle = -1, cnt = 0, count = 0;
+    float stackT[64];
+
+    while (cnt != -1)
+    {
+        if (count > 0)
+        {
+            rayStats.leafVisits++;
+            for (int i = cnt; i < cnt + count; i++)
+            {
+                vec3 hitPoint; int triangle = LeafTriangle(i);
+                if (RayTriangleIntersect(ray, LoadTriangle(triangle), t, hitPoint) && t < closestT)
+                {
+                    closestT = t;
+                    hitTriangle = triangle;
+                }
+            }
+        }
+        else
+        {
+            int base = cnt * stride;
+            rayStats.innerVisits++;
+
+            float tLeft = QuantizedChildNear(ray, invDir, base, 0), tRight = QuantizedChildNear(ray, invDir, base, 1);
+            int nearChild = tRight < tLeft ? 1 : 0, farChild = 1 - nearChild;
+            float tNear = min(tLeft, tRight), tFar = max(tLeft, tRight);
+
+            if (tNear < closestT)
+            {
+                rayStats.aabbHits++;
+                uint counts = quantizedNodes[base + 6];
+                if (tFar < closestT)
+                {
+                    rayStats.aabbHits++;
+                    stack[top] = int(quantizedNodes[base + 4 + farChild]);
+                    stackCount[top] = int(bitfieldExtract(counts, 16 * farChild, 16));
+                    stackT[top++] = tFar;
+                    rayStats.stackDepth = max(rayStats.stackDepth, top);
+                }
+                cnt = int(quantizedNodes[base + 4 + nearChild]);
+                count = int(bitfieldExtract(counts, 16 * nearChild, 16));
+                continue;
+            }
+        }
+
+        cnt = -1;
+        while (top > 0 && cnt == -1)
+        {
+            top--;
+            if (stackT[top] < closestT)
+            {
+                cnt = stack[top];
+                count = stackCount[top];
+            }
+        }
+    }
+
+    if (hitTriangle == -1) return color;
+
+    vec3 hitPoint = ray.origin + closestT * ray.direction;
+    vec3 lightPos = vec3(10.0, 10.0, 10.0);
+    vec3 lightDir = normalize(lightPos - hitPoint);
+    float diff = max(dot(TriangleNormal(hitTriangle), lightDir), 0.0);
+    return vec3(0.8) * diff;
+}
+
+void IntersectBLAS(Ray ray, int root, inout float closestT, inout int hitTriangle)
+{
+    vec3 invDir = 1.0 / ray.direction;
+    int stack[64], top = 0;
+    stack[top++] = root;
+
+    while (top > 0)
+    {
+        int cnt = stack[--top];
+        if (RayAABBNear(ray, invDir, bvhNodes[cnt].aabbMin, bvhNodes[cnt].aabbMax) >= closestT) continue;
+
+        rayStats.aabbHits++;
+
+        if (bvhNodes[cnt].count == 0)
+        {
+            rayStats.innerVisits++;
+            stack[top++] = bvhNodes[cnt].right;
+            stack[top++] = bvhNodes[cnt].left;
+            rayStats.stackDepth = max(rayStats.stackDepth, top);
+        }
+        else
+        {
+            rayStats.leafVisits++;
+            for (int i = bvhNodes[cnt].left; i < bvhNodes[cnt].right; i++)
+            {
+                float t; vec3 hitPoint; int triangle = LeafTriangle(i);
+                if (RayTriangleIntersect(ray, LoadTriangle(triangle), t, hitPoint) && t < closestT)
+                {
+                    closestT = t;
+                    hitTriangle = triangle;
+                }
+            }
+        }
+    }
+}
+
+vec3 RayTraceInstances(Ray ray)
+{
+    float t = (ray.direction.y + 1.0) * 0.5, closestT = 1e20;
+    vec3 color = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+    vec3 invDir = 1.0 / ray.direction;
+
+    int stack[64], top = 0, hitTriangle = -1, hitInstance = -1;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        int cnt = stack[--top];
+        if (RayAABBNear(ray, invDir, tlasNodes[cnt].aabbMin, tlasNodes[cnt].aabbMax) >= closestT) continue;
+
+        rayStats.aabbHits++;
+
+        if (tlasNodes[cnt].count == 0)
+        {
+            rayStats.innerVisits++;
+            stack[top++] = tlasNodes[cnt].right;
+            stack[top++] = tlasNodes[cnt].left;
+            rayStats.stackDepth = max(rayStats.stackDepth, top);
+            continue;
+        }
+
+        rayStats.leafVisits++;
+
+        for (int i = tlasNodes[cnt].left; i < tlasNodes[cnt].right; i++)
+        {
+            Ray local;
+            local.origin = vec3(dot(instances[i].worldToObject[0], vec4(ray.origin, 1.0)), dot(instances[i].worldToObject[1], vec4(ray.origin, 1.0)), dot(instances[i].worldToObject[2], vec4(ray.origin, 1.0)));
+            local.direction = vec3(dot(instances[i].worldToObject[0], vec4(ray.direction, 0.0)), dot(instances[i].worldToObject[1], vec4(ray.direction, 0.0)), dot(instances[i].worldToObject[2], vec4(ray.direction, 0.0)));
+
+            float previousT = closestT;
+            IntersectBLAS(local, instances[i].blasRoot, closestT, hitTriangle);
+            if (closestT < previousT) hitInstance = i;
+        }
+    }
+
+    if (hitTriangle == -1) return color;
+
+    mat3 normalToWorld = mat3(instances[hitInstance].worldToObject[0].xyz, instances[hitInstance].worldToObject[1].xyz, instances[hitInstance].worldToObject[2].xyz);
+    vec3 normal = normalize(normalToWorld * TriangleNormal(hitTriangle));
+    vec3 hitPoint = ray.origin + closestT * ray.direction;
+    vec3 lightPos = vec3(10.0, 10.0, 10.0);
+    vec3 lightDir = normalize(lightPos - hitPoint);
+    float diff = max(dot(normal, lightDir), 0.0);
+    return vec3(0.8) * diff;
+}
+
+void main()
+{
+    float u = screenCoord.x, v = screenCoord.y;
+
+    Ray ray = CreateRay(camera.position, camera.forward + 4 * (u - 0.5) * camera.right + 3 * (v - 0.5) * camera.up);
+    rayStats = TraversalStats(0, 0, 0, 0, 0, 0);
+
+    //FragColor = vec4(1.0, 1.0, 1.0, 1.0);
+    //FragColor = vec4(vec3(bvhNodes[0].left), 1.0);
+    //FragColor = vec4(RayTrace(ray), 1.0);
+    if (instanceCount > 0) FragColor = vec4(RayTraceInstances(ray), 1.0);
+    else if (quantizedBits > 0) FragColor = vec4(RayTraceQuantized(ray), 1.0);
+    else if (bvhTraversal == 1) FragColor = vec4(RayTraceBVHOrdered(ray), 1.0);
+    else if (bvhLayout == 1) FragColor = vec4(RayTraceBVHStackless(ray), 1.0);
+    else FragColor = vec4(RayTraceBVH(ray), 1.0);
+
+    traversalStats[int(gl_FragCoord.y) * 800 + int(gl_FragCoord.x)] = rayStats;
 }
\ No newline at end of file
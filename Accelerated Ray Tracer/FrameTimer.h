@@ -0,0 +1,151 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include "AcceleratedRayTracer.h"
+
+const double frameBucketMs = 0.05;
+const int frameBucketCount = 4000, gpuQueryRing = 4;
+
+struct FrameTimeHistogram
+{
+public:
+	int count; double total, peak;
+
+	FrameTimeHistogram() : count(0), total(0), peak(0), buckets(frameBucketCount, 0) {}
+
+	void Add(double ms)
+	{
+		int bucket = int(ms / frameBucketMs);
+		if (bucket < frameBucketCount) buckets[bucket]++;
+		else overflow.push_back(ms);
+		count++;
+		total += ms;
+		peak = std::max(peak, ms);
+	}
+
+	double Mean() const { return count ? total / count : 0.0; }
+
+	double Percentile(double fraction) const
+	{
+		int rank = std::max(1, int(ceil(fraction * count))), seen = 0;
+		for (int i = 0; i < frameBucketCount && count > 0; i++)
+			if ((seen += buckets[i]) >= rank) return std::min(peak, (i + 1) * frameBucketMs);
+		if (overflow.empty()) return peak;
+
+		vector<double> sorted(overflow);
+		std::sort(sorted.begin(), sorted.end());
+		return sorted[std::min(sorted.size(), size_t(rank - seen)) - 1];
+	}
+
+	void Reset()
+	{
+		std::fill(buckets.begin(), buckets.end(), 0);
+		overflow.clear();
+		count = 0;
+		total = 0;
+		peak = 0;
+	}
+
+private:
+	vector<int> buckets; vector<double> overflow;
+};
+
+struct FrameTimer
+{
+public:
+	FrameTimeHistogram cpu, gpu, sessionCPU, sessionGPU;
+	int droppedQueries;
+
+	FrameTimer(const string& logPath) : droppedQueries(0), next(0), timing(false), started(false)
+	{
+		glGenQueries(gpuQueryRing, queries);
+		std::fill(pending, pending + gpuQueryRing, false);
+		if (logPath.empty()) return;
+		log.open(logPath, ios::trunc);
+		if (log) log << "time,frames,cpuMean,cpuP50,cpuP95,cpuP99,cpuMax,gpuMean,gpuP50,gpuP95,gpuP99,gpuMax\n";
+		else cerr << "Failed to open frame log " << logPath << endl;
+	}
+
+	void BeginFrame()
+	{
+		auto now = std::chrono::high_resolution_clock::now();
+		if (started) AddCPU(std::chrono::duration<double, milli>(now - lastFrame).count());
+		started = true;
+		lastFrame = now;
+
+		for (int i = 0; i < gpuQueryRing; i++)
+		{
+			int slot = (next + i) % gpuQueryRing;
+			if (!pending[slot]) continue;
+			GLint available = 0;
+			glGetQueryObjectiv(queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) break;
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &elapsed);
+			AddGPU(elapsed / 1e6);
+			pending[slot] = false;
+		}
+	}
+
+	void BeginGPU()
+	{
+		timing = !pending[next];
+		if (timing) glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+		else droppedQueries++;
+	}
+
+	void EndGPU()
+	{
+		if (!timing) return;
+		glEndQuery(GL_TIME_ELAPSED);
+		pending[next] = true;
+		next = (next + 1) % gpuQueryRing;
+		timing = false;
+	}
+
+	string Summary() const
+	{
+		char text[128];
+		snprintf(text, sizeof(text), "CPU %.1f/%.1f/%.1f ms - GPU %.1f/%.1f/%.1f ms (p50/p95/p99)", cpu.Percentile(0.5), cpu.Percentile(0.95), cpu.Percentile(0.99), gpu.Percentile(0.5), gpu.Percentile(0.95), gpu.Percentile(0.99));
+		return text;
+	}
+
+	void Report(double time)
+	{
+		if (log)
+		{
+			char line[256];
+			snprintf(line, sizeof(line), "%.3f,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", time, cpu.count, cpu.Mean(), cpu.Percentile(0.5), cpu.Percentile(0.95), cpu.Percentile(0.99), cpu.peak,
+				gpu.Mean(), gpu.Percentile(0.5), gpu.Percentile(0.95), gpu.Percentile(0.99), gpu.peak);
+			log << line << flush;
+		}
+		cpu.Reset();
+		gpu.Reset();
+	}
+
+	void PrintSession() const
+	{
+		printf("%-4s %8s %8s %8s %8s %8s %8s\n", "", "Frames", "Mean", "p50", "p95", "p99", "Max");
+		const FrameTimeHistogram* histograms[] = { &sessionCPU, &sessionGPU };
+		for (int i = 0; i < 2; i++)
+			printf("%-4s %8d %8.2f %8.2f %8.2f %8.2f %8.2f\n", i ? "GPU" : "CPU", histograms[i]->count, histograms[i]->Mean(), histograms[i]->Percentile(0.5), histograms[i]->Percentile(0.95), histograms[i]->Percentile(0.99), histograms[i]->peak);
+		if (droppedQueries) printf("%d frames skipped GPU timing because every query was still in flight\n", droppedQueries);
+	}
+
+private:
+	uint queries[gpuQueryRing]; bool pending[gpuQueryRing];
+	int next; bool timing, started;
+	std::chrono::high_resolution_clock::time_point lastFrame;
+	ofstream log;
+
+	void AddCPU(double ms)
+	{
+		cpu.Add(ms);
+		sessionCPU.Add(ms);
+	}
+	void AddGPU(double ms)
+	{
+		gpu.Add(ms);
+		sessionGPU.Add(ms);
+	}
+};
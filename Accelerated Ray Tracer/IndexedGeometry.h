@@ -0,0 +1,64 @@
+#pragma once
+#include <cstring>
+#include <unordered_map>
+#include "RayTraceModels.h"
+
+struct VertexKeyHash
+{
+	size_t operator()(const vec3& v) const
+	{
+		vec3 key = v + vec3(0.0f);
+		uint32_t bits[3]; memcpy(bits, &key, sizeof(bits));
+		uint64_t hash = 14695981039346656037ull;
+		for (uint32_t word : bits) hash = (hash ^ word) * 1099511628211ull;
+		return size_t(hash);
+	}
+};
+
+struct IndexedGeometry
+{
+public:
+	vector<vec3> vertices; vector<uvec3> indices;
+
+	void Build(const Triangle* triangles, int triangleCount)
+	{
+		vertices.clear();
+		source.clear();
+		indices.resize(triangleCount);
+
+		unordered_map<vec3, uint32_t, VertexKeyHash> lookup;
+		lookup.reserve(triangleCount);
+		for (int i = 0; i < triangleCount; i++)
+			for (int corner = 0; corner < 3; corner++)
+			{
+				const vec3& v = Corner(triangles[i], corner);
+				auto inserted = lookup.emplace(v, uint32_t(vertices.size()));
+				if (inserted.second)
+				{
+					vertices.push_back(v);
+					source.push_back(i * 3 + corner);
+				}
+				indices[i][corner] = inserted.first->second;
+			}
+	}
+
+	void Refresh(const Triangle* triangles, ThreadPool* pool = nullptr)
+	{
+		ParallelFor(pool, 0, int(vertices.size()), parallelLoopGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++) vertices[i] = Corner(triangles[source[i] / 3], source[i] % 3);
+		});
+	}
+
+	vec3 Normal(int triangle) const
+	{
+		const uvec3& face = indices[triangle];
+		return normalize(cross(vertices[face.y] - vertices[face.x], vertices[face.z] - vertices[face.x]));
+	}
+
+	size_t ByteSize() const { return vertices.size() * sizeof(vec3) + indices.size() * sizeof(uvec3); }
+
+private:
+	vector<int> source;
+
+	static const vec3& Corner(const Triangle& tri, int corner) { return corner == 0 ? tri.v0 : corner == 1 ? tri.v1 : tri.v2; }
+};
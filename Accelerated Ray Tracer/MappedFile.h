@@ -0,0 +1,73 @@
+#pragma once
+#include <string>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+using namespace std;
+
+struct MappedFile
+{
+public:
+	const char* data; size_t size;
+
+	MappedFile(const string& path) : data(nullptr), size(0), isOpen(false)
+	{
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		mapping = NULL;
+		if (file == INVALID_HANDLE_VALUE) return;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize)) return;
+		size = size_t(fileSize.QuadPart); isOpen = true;
+		if (size == 0) return;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping) data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		file = open(path.c_str(), O_RDONLY);
+		if (file < 0) return;
+		struct stat info;
+		if (fstat(file, &info) != 0) return;
+		size = size_t(info.st_size); isOpen = true;
+		if (size == 0) return;
+		void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (view != MAP_FAILED) data = (const char*)view;
+#endif
+		if (!data) isOpen = false;
+	}
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+		if (data) munmap((void*)data, size);
+		if (file >= 0) close(file);
+#endif
+	}
+
+	bool IsOpen() const { return isOpen; }
+
+private:
+	bool isOpen;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#else
+	int file;
+#endif
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
\ No newline at end of file
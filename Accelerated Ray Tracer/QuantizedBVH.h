@@ -0,0 +1,131 @@
+#pragma once
+#include <cstring>
+#include <type_traits>
+#include <immintrin.h>
+#include "RayTraceModels.h"
+
+inline __m128 LoadCodes(const uint8_t* codes)
+{
+	int word; memcpy(&word, codes, sizeof(int));
+	__m128i zero = _mm_setzero_si128();
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(word), zero), zero));
+}
+
+inline __m128 LoadCodes(const uint16_t* codes)
+{
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)codes), _mm_setzero_si128()));
+}
+
+template<int Bits>
+struct QuantizedBVHNode
+{
+	typedef typename std::conditional<Bits == 8, uint8_t, uint16_t>::type Code;
+
+	float origin[3]; uint8_t exponent[3], pad;
+	int link[2]; uint16_t count[2];
+	Code bounds[3][4];
+
+	void IntersectChildren(const vec3& rayOrigin, const vec3& invDir, float* tEntry) const
+	{
+		__m128 tMin = _mm_setzero_ps(), tMax = _mm_set1_ps(FLT_MAX);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m128 box = _mm_add_ps(_mm_set1_ps(origin[axis]), _mm_mul_ps(LoadCodes(bounds[axis]), _mm_set1_ps(ExponentScale(exponent[axis]))));
+			__m128 t = _mm_mul_ps(_mm_sub_ps(box, _mm_set1_ps(rayOrigin[axis])), _mm_set1_ps(invDir[axis])), swapped = _mm_shuffle_ps(t, t, _MM_SHUFFLE(1, 0, 3, 2));
+			tMin = _mm_max_ps(tMin, _mm_min_ps(t, swapped));
+			tMax = _mm_min_ps(tMax, _mm_max_ps(t, swapped));
+		}
+
+		alignas(16) float entry[4];
+		_mm_store_ps(entry, tMin);
+		int mask = _mm_movemask_ps(_mm_cmplt_ps(tMin, tMax));
+		for (int child = 0; child < 2; child++) tEntry[child] = (mask >> child & 1) && link[child] != -1 ? entry[child] : FLT_MAX;
+	}
+
+	static float Decode(float origin, float scale, int code) { return origin + float(code) * scale; }
+
+	static float ExponentScale(uint8_t exponent)
+	{
+		uint32_t bits = uint32_t(exponent) << 23; float scale;
+		memcpy(&scale, &bits, sizeof(float));
+		return scale;
+	}
+};
+
+template<int Bits>
+struct QuantizedBVH
+{
+public:
+	typedef QuantizedBVHNode<Bits> Node;
+	typedef typename Node::Code Code;
+	static const int maxCode = (1 << Bits) - 1;
+
+	vector<Node> nodes;
+
+	void Quantize(const FlattenedBVHNode* binary, int nodeCount)
+	{
+		nodes.clear();
+		if (nodeCount > 0) QuantizeNode(binary, 0);
+	}
+
+private:
+	int QuantizeNode(const FlattenedBVHNode* binary, int index)
+	{
+		int quantizedIndex = int(nodes.size());
+		nodes.push_back(Node());
+
+		const FlattenedBVHNode& parent = binary[index];
+		int children[2] = { parent.left, parent.right };
+		if (parent.count > 0)
+		{
+			children[0] = index;
+			children[1] = -1;
+		}
+
+		Node node = {};
+		for (int axis = 0; axis < 3; axis++)
+		{
+			node.origin[axis] = parent.aabbMin[axis];
+			int exponent, biased;
+			frexp((parent.aabbMax[axis] - parent.aabbMin[axis]) / float(maxCode), &exponent);
+			for (biased = std::max(1, std::min(254, exponent + 127)); biased < 254; biased++)
+			{
+				bool fits = true;
+				for (int i = 0; i < 2 && fits; i++)
+					if (children[i] != -1)
+						fits = QuantizeAxis(node.origin[axis], Node::ExponentScale(uint8_t(biased)), binary[children[i]].aabbMin[axis], binary[children[i]].aabbMax[axis], node.bounds[axis][i], node.bounds[axis][i + 2]);
+				if (fits) break;
+			}
+			node.exponent[axis] = uint8_t(biased);
+		}
+
+		for (int i = 0; i < 2; i++)
+		{
+			const FlattenedBVHNode* child = children[i] != -1 ? &binary[children[i]] : nullptr;
+			node.link[i] = !child ? -1 : child->count > 0 ? child->left : 0;
+			node.count[i] = child ? uint16_t(child->count) : 0;
+		}
+		nodes[quantizedIndex] = node;
+
+		for (int i = 0; i < 2; i++)
+			if (children[i] != -1 && binary[children[i]].count == 0)
+			{
+				int child = QuantizeNode(binary, children[i]);
+				nodes[quantizedIndex].link[i] = child;
+			}
+
+		return quantizedIndex;
+	}
+
+	static bool QuantizeAxis(float origin, float scale, float lo, float hi, Code& qlo, Code& qhi)
+	{
+		const int limit = maxCode;
+		int low = int(std::max(0.0f, std::min(float(limit), floor((lo - origin) / scale))));
+		int high = int(std::max(0.0f, std::min(float(limit), ceil((hi - origin) / scale))));
+		while (low > 0 && Node::Decode(origin, scale, low) > lo) low--;
+		while (high < limit && Node::Decode(origin, scale, high) < hi) high++;
+		qlo = Code(low);
+		qhi = Code(high);
+		return Node::Decode(origin, scale, low) <= lo && Node::Decode(origin, scale, high) >= hi;
+	}
+};
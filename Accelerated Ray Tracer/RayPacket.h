@@ -0,0 +1,86 @@
+#pragma once
+#include <immintrin.h>
+#include "RayTraceModels.h"
+
+const int packetDivergenceLanes = 2;
+
+template<int K>
+struct RayPacket
+{
+public:
+	alignas(32) float origin[3][K], invDir[3][K], closestT[K];
+	Ray rays[K];
+	int active;
+
+	RayPacket() : active(0) {}
+
+	void SetRay(int lane, const Ray& ray)
+	{
+		rays[lane] = ray; active |= 1 << lane;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			origin[axis][lane] = ray.origin[axis];
+			invDir[axis][lane] = 1.0f / ray.direction[axis];
+		}
+		closestT[lane] = 1e20f;
+	}
+
+	void Clear()
+	{
+		active = 0;
+		for (int lane = 0; lane < K; lane++)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				origin[axis][lane] = 0.0f;
+				invDir[axis][lane] = 1.0f;
+			}
+			closestT[lane] = 0.0f;
+		}
+	}
+};
+
+inline int PopCount(uint32_t x)
+{
+#ifdef _MSC_VER
+	return int(__popcnt(x));
+#else
+	return __builtin_popcount(x);
+#endif
+}
+
+template<int K>
+inline int PacketIntersectAABB(const RayPacket<K>& packet, const vec3& aabbMin, const vec3& aabbMax)
+{
+	int mask = 0;
+#ifdef __AVX__
+	for (int block = 0; block < K; block += 8)
+	{
+		__m256 tMin = _mm256_setzero_ps(), tMax = _mm256_loadu_ps(packet.closestT + block);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m256 o = _mm256_loadu_ps(packet.origin[axis] + block), inv = _mm256_loadu_ps(packet.invDir[axis] + block);
+			__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(aabbMin[axis]), o), inv);
+			__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(aabbMax[axis]), o), inv);
+			tMin = _mm256_max_ps(tMin, _mm256_min_ps(t0, t1));
+			tMax = _mm256_min_ps(tMax, _mm256_max_ps(t0, t1));
+		}
+		mask |= _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ)) << block;
+	}
+#else
+	for (int block = 0; block < K; block += 4)
+	{
+		__m128 tMin = _mm_setzero_ps(), tMax = _mm_loadu_ps(packet.closestT + block);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m128 o = _mm_loadu_ps(packet.origin[axis] + block), inv = _mm_loadu_ps(packet.invDir[axis] + block);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aabbMin[axis]), o), inv);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aabbMax[axis]), o), inv);
+			tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+			tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+		}
+		mask |= _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << block;
+	}
+#endif
+	return mask & packet.active;
+}
\ No newline at end of file
@@ -1,309 +1,1244 @@
-#pragma once
-#include <queue>
-#include <string>
-#include <vector>
-#include <fstream>
-#include <sstream>
-#include <iostream>
-#include <algorithm>
-#include <GL/glew.h>
-#include <GL/glut.h>
-#include <glm/glm.hpp>
-#include <glm/gtc/type_ptr.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-#include <glm/gtx/rotate_vector.hpp>
-#include <GLFW/glfw3.h>
-#define uint unsigned int 
-using namespace std;
-using namespace glm;
-
-struct Ray
-{
-	vec3 origin, direction;
-	Ray(vec3 o, vec3 d) : origin(o), direction(normalize(d)) {}
-};
-
-struct AABB
-{
-	vec3 min, max;
-
-	AABB() : min(vec3(FLT_MAX)), max(vec3(-FLT_MAX)) {}
-	AABB(vec3 a, vec3 b) : min(a), max(b) {}
-
-	void Expand(const AABB& other)
-	{
-		min = glm::min(min, other.min);
-		max = glm::max(max, other.max);
-	}
-
-	void Expand(const vec3& point)
-	{
-		min = glm::min(min, point);
-		max = glm::max(max, point);
-	}
-
-	float SurfaceArea()
-	{
-		vec3 extent = max - min;
-		return 2.0f * (extent.x * extent.y + extent.x * extent.z + extent.y * extent.z);
-	}
-};
-
-struct Triangle
-{
-	vec3 v0; float pad0;
-	vec3 v1; float pad1;
-	vec3 v2; float pad2;
-	vec3 n; float pad3;
-
-	Triangle(vec3 _v0, vec3 _v1, vec3 _v2) : v0(_v0), v1(_v1), v2(_v2), n(normalize(cross(_v1 - _v0, _v2 - _v0))) {}
-
-	Triangle(vec3 _v0, vec3 _v1, vec3 _v2, vec3 _n) : v0(_v0), v1(_v1), v2(_v2), n(normalize(_n)) {}
-
-	bool operator<(const Triangle& other) const
-	{
-		if (v0.x != other.v0.x) return v0.x < other.v0.x;
-		if (v0.y != other.v0.y) return v0.y < other.v0.y;
-		if (v0.z != other.v0.z) return v0.z < other.v0.z;
-		if (v1.x != other.v1.x) return v1.x < other.v1.x;
-		if (v1.y != other.v1.y) return v1.y < other.v1.y;
-		if (v1.z != other.v1.z) return v1.z < other.v1.z;
-		if (v2.x != other.v2.x) return v2.x < other.v2.x;
-		if (v2.y != other.v2.y) return v2.y < other.v2.y;
-		if (v2.z != other.v2.z) return v2.z < other.v2.z;
-		return false;
-	}
-
-	void GetAABB(vec3& minCorner, vec3& maxCorner)
-	{
-		minCorner = min(v0, min(v1, v2));
-		maxCorner = max(v0, max(v1, v2));
-	}
-
-	AABB GetAABB()
-	{
-		AABB box;
-		box.Expand(v0);
-		box.Expand(v1);
-		box.Expand(v2);
-		return box;
-	}
-};
-
-struct BVHNode
-{
-	AABB box;
-	BVHNode* left, * right;
-	int n, index;
-
-	BVHNode() : left(nullptr), right(nullptr), n(0), index(0) {}
-};
-
-struct FlattenedBVHNode
-{
-	int left, right, count, pad0;
-	vec3 aabbMin; float pad1; vec3 aabbMax; float pad2;
-};
-
-struct Model
-{
-	vector<Triangle> triangles;
-
-	bool LoadModel(const string& filepath)
-	{
-		ifstream file(filepath);
-		string line;
-		vector<vec3> vertices, normals;
-		if (!file.is_open()) return false;
-
-		while (getline(file, line))
-		{
-			istringstream s(line);
-			string type, s1, s2, s3;
-			float x, y, z;
-			int v0, v1, v2, vn0, vn1, vn2;
-
-			s >> type;
-			if (type == "v")
-			{
-				s >> x >> y >> z;
-				vertices.push_back(vec3(x, y, z));
-			}
-			//else if (type == "vn") 
-			//{
-			//	s >> x >> y >> z;
-			//	normals.push_back(vec3(x, y, z));
-			//}
-			else if (type == "f")
-			{
-				s >> s1 >> s2 >> s3;
-
-				v0 = stoi(s1.substr(0, s1.find('/'))) - 1;
-				v1 = stoi(s2.substr(0, s2.find('/'))) - 1;
-				v2 = stoi(s3.substr(0, s3.find('/'))) - 1;
-
-				//vn0 = stoi(s1.substr(s1.find("//") + 2)) - 1;
-				//vn1 = stoi(s2.substr(s2.find("//") + 2)) - 1;
-				//vn2 = stoi(s3.substr(s3.find("//") + 2)) - 1;
-
-				triangles.emplace_back(
-					vertices[v0], vertices[v1], vertices[v2]
-					//,normals[vn0] + normals[vn1] + normals[vn2] 
-				);
-			}
-		}
-
-		file.close();
-		return true;
-	}
-
-	BVHNode* BuildBVH(int start, int end)
-	{
-		BVHNode* node = new BVHNode(); AABB box;
-		for (int i = start; i < end; i++)
-		{
-			vec3 minCorner, maxCorner;
-			triangles[i].GetAABB(minCorner, maxCorner);
-			box.Expand(AABB(minCorner, maxCorner));
-		}
-		node->box = box;
-
-		int count = end - start;
-		if (count <= 4)
-		{
-			node->n = count;
-			node->index = start;
-			return node;
-		}
-
-		vec3 extent = box.max - box.min;
-		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
-
-		sort(triangles.begin() + start, triangles.begin() + end,
-			[axis](const Triangle& a, const Triangle& b) {
-				return (a.v0[axis] + a.v1[axis] + a.v2[axis]) / 3 <
-					(b.v0[axis] + b.v1[axis] + b.v2[axis]) / 3;
-			});
-
-		int mid = start + count / 2;
-		node->left = BuildBVH(start, mid);
-		node->right = BuildBVH(mid, end);
-		return node;
-	}
-
-	BVHNode* BuildBVHSAH(int start, int end)
-	{
-		BVHNode* node = new BVHNode();
-		AABB box;
-
-		for (int i = start; i < end; i++)
-		{
-			vec3 minCorner, maxCorner;
-			triangles[i].GetAABB(minCorner, maxCorner);
-			box.Expand(AABB(minCorner, maxCorner));
-		}
-		node->box = box;
-
-		int count = end - start;
-		if (count <= 4)
-		{
-			node->n = count;
-			node->index = start;
-			return node;
-		}
-
-		float bestCost = FLT_MAX;
-		int bestAxis = -1, bestSplit = -1;
-
-		for (int axis = 0; axis < 3; axis++)
-		{
-			sort(triangles.begin() + start, triangles.begin() + end,
-				[axis](const Triangle& a, const Triangle& b) {
-					return (a.v0[axis] + a.v1[axis] + a.v2[axis]) / 3 <
-						(b.v0[axis] + b.v1[axis] + b.v2[axis]) / 3;
-				});
-
-			vector<AABB> prefixAABB(count), suffixAABB(count);
-			prefixAABB[0] = triangles[start].GetAABB();
-			for (int i = 1; i < count; i++)
-			{
-				prefixAABB[i] = prefixAABB[i - 1];
-				prefixAABB[i].Expand(triangles[start + i].GetAABB());
-			}
-
-			suffixAABB[count - 1] = triangles[end - 1].GetAABB();
-			for (int i = count - 2; i >= 0; i--)
-			{
-				suffixAABB[i] = suffixAABB[i + 1];
-				suffixAABB[i].Expand(triangles[start + i].GetAABB());
-			}
-
-			for (int i = 1; i < count; i++)
-			{
-				float leftArea = prefixAABB[i - 1].SurfaceArea();
-				float rightArea = suffixAABB[i].SurfaceArea();
-				float cost = leftArea * i + rightArea * (count - i);
-
-				if (cost < bestCost)
-				{
-					bestCost = cost;
-					bestAxis = axis;
-					bestSplit = i;
-				}
-			}
-		}
-
-		sort(triangles.begin() + start, triangles.begin() + end,
-			[bestAxis](const Triangle& a, const Triangle& b) {
-				return (a.v0[bestAxis] + a.v1[bestAxis] + a.v2[bestAxis]) / 3 <
-					(b.v0[bestAxis] + b.v1[bestAxis] + b.v2[bestAxis]) / 3;
-			});
-
-		int mid = start + bestSplit;
-		node->left = BuildBVHSAH(start, mid);
-		node->right = BuildBVHSAH(mid, end);
-
-		return node;
-	}
-
-	void SerializeBVH(vector<FlattenedBVHNode>& flattenedBVH, BVHNode* root)
-	{
-		if (!root) return;
-
-		queue<pair<BVHNode*, int>> q;
-		q.push({ root, -1 });
-
-		while (!q.empty())
-		{
-			BVHNode* node = q.front().first;
-			int index = q.front().second;
-			if (index != -1)
-			{
-				int father = index / 10; bool isLeft = index % 10 == 0;
-				if (isLeft) flattenedBVH[father].left = flattenedBVH.size();
-				else flattenedBVH[father].right = flattenedBVH.size();
-			}
-			q.pop();
-
-			FlattenedBVHNode flatNode;
-			flatNode.aabbMin = node->box.min;
-			flatNode.aabbMax = node->box.max;
-
-			if (node->n > 0)
-			{
-				flatNode.left = node->index;
-				flatNode.right = node->index + node->n;
-				flatNode.count = node->n;
-			}
-			else
-			{
-				flatNode.count = 0;
-
-				if (node->left) q.push({ node->left, 10 * flattenedBVH.size() });
-				if (node->right) q.push({ node->right, 10 * flattenedBVH.size() + 1 });
-			}
-
-			flattenedBVH.push_back(flatNode);
-		}
-	}
-};
\ No newline at end of file
+#pragma once
+#include <queue>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <GL/glew.h>
+#include <GL/glut.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/rotate_vector.hpp>
+#include <GLFW/glfw3.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#define uint unsigned int 
+using namespace std;
+using namespace glm;
+
+const int parallelTaskThreshold = 1024, parallelLoopThreshold = 8192, parallelLoopGrain = 4096;
+
+struct Ray
+{
+	vec3 origin, direction;
+	Ray() {}
+	Ray(vec3 o, vec3 d) : origin(o), direction(normalize(d)) {}
+};
+
+struct AABB
+{
+	vec3 min, max;
+
+	AABB() : min(vec3(FLT_MAX)), max(vec3(-FLT_MAX)) {}
+	AABB(vec3 a, vec3 b) : min(a), max(b) {}
+
+	void Expand(const AABB& other)
+	{
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+	}
+
+	void Expand(const vec3& point)
+	{
+		min = glm::min(min, point);
+		max = glm::max(max, point);
+	}
+
+	bool IsEmpty() const
+	{
+		return min.x > max.x || min.y > max.y || min.z > max.z;
+	}
+
+	float SurfaceArea() const
+	{
+		vec3 extent = max - min;
+		return 2.0f * (extent.x * extent.y + extent.x * extent.z + extent.y * extent.z);
+	}
+};
+
+struct Triangle
+{
+	vec3 v0; float pad0;
+	vec3 v1; float pad1;
+	vec3 v2; float pad2;
+	vec3 n; float pad3;
+
+	Triangle(vec3 _v0, vec3 _v1, vec3 _v2) : v0(_v0), pad0(0), v1(_v1), pad1(0), v2(_v2), pad2(0), n(normalize(cross(_v1 - _v0, _v2 - _v0))), pad3(0) {}
+
+	Triangle(vec3 _v0, vec3 _v1, vec3 _v2, vec3 _n) : v0(_v0), pad0(0), v1(_v1), pad1(0), v2(_v2), pad2(0), n(normalize(_n)), pad3(0) {}
+
+	bool operator<(const Triangle& other) const
+	{
+		if (v0.x != other.v0.x) return v0.x < other.v0.x;
+		if (v0.y != other.v0.y) return v0.y < other.v0.y;
+		if (v0.z != other.v0.z) return v0.z < other.v0.z;
+		if (v1.x != other.v1.x) return v1.x < other.v1.x;
+		if (v1.y != other.v1.y) return v1.y < other.v1.y;
+		if (v1.z != other.v1.z) return v1.z < other.v1.z;
+		if (v2.x != other.v2.x) return v2.x < other.v2.x;
+		if (v2.y != other.v2.y) return v2.y < other.v2.y;
+		if (v2.z != other.v2.z) return v2.z < other.v2.z;
+		return false;
+	}
+
+	void GetAABB(vec3& minCorner, vec3& maxCorner)
+	{
+		minCorner = min(v0, min(v1, v2));
+		maxCorner = max(v0, max(v1, v2));
+	}
+
+	AABB GetAABB()
+	{
+		AABB box;
+		box.Expand(v0);
+		box.Expand(v1);
+		box.Expand(v2);
+		return box;
+	}
+};
+
+struct PrimitiveRef
+{
+	AABB box; vec3 centroid; int index;
+};
+
+struct PLOCCluster
+{
+	AABB box; int left, right, count;
+};
+
+struct BVHNode
+{
+	AABB box;
+	BVHNode* left, * right;
+	int n, index;
+
+	BVHNode() : left(nullptr), right(nullptr), n(0), index(0) {}
+};
+
+struct BVHNodeArena
+{
+public:
+	BVHNodeArena() : used(0) {}
+	BVHNodeArena(const BVHNodeArena&) : used(0) {}
+	BVHNodeArena& operator=(const BVHNodeArena&) { return *this; }
+
+	void Reset(int capacity)
+	{
+		if (int(nodes.size()) < capacity) nodes.resize(capacity);
+		used = 0;
+	}
+
+	BVHNode* Allocate()
+	{
+		int index = used++;
+		if (index >= int(nodes.size()))
+		{
+			cerr << "BVH node arena overflow: capacity " << nodes.size() << endl;
+			abort();
+		}
+		BVHNode* node = &nodes[index];
+		*node = BVHNode();
+		return node;
+	}
+
+	int Size() const { return used; }
+
+private:
+	vector<BVHNode> nodes;
+	atomic<int> used;
+};
+
+struct FlattenedBVHNode
+{
+	int left, right, count, skip;
+	vec3 aabbMin; float pad1; vec3 aabbMax; float pad2;
+};
+
+float ComputeSAHCost(const FlattenedBVHNode* nodes, int nodeCount, float traversalCost = 1.0f, float intersectionCost = 1.0f)
+{
+	if (nodeCount == 0) return 0.0f;
+
+	float rootArea = AABB(nodes[0].aabbMin, nodes[0].aabbMax).SurfaceArea(), cost = 0.0f;
+	for (int i = 0; i < nodeCount; i++)
+	{
+		const FlattenedBVHNode& node = nodes[i];
+		float area = AABB(node.aabbMin, node.aabbMax).SurfaceArea();
+		cost += area * (node.count == 0 ? traversalCost : intersectionCost * node.count);
+	}
+	return rootArea > 0.0f ? cost / rootArea : 0.0f;
+}
+
+inline double PowerOfTen(int exponent)
+{
+	static const double table[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	return exponent <= 22 ? table[exponent] : pow(10.0, exponent);
+}
+
+inline bool ParseFloat(const char*& p, const char* end, float& value)
+{
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+	uint64_t mantissa = 0; int exponent = 0, digits = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		if (mantissa < 100000000000000000ull) mantissa = mantissa * 10 + (*p - '0');
+		else exponent++;
+	if (p < end && *p == '.')
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+			if (mantissa < 100000000000000000ull)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			}
+	if (digits == 0) return false;
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		bool negativeExponent = false; int e = 0;
+		if (++p < end && (*p == '-' || *p == '+')) negativeExponent = *p++ == '-';
+		for (; p < end && *p >= '0' && *p <= '9'; p++) e = std::min(e * 10 + (*p - '0'), 1000);
+		exponent += negativeExponent ? -e : e;
+	}
+
+	double result = exponent < 0 ? double(mantissa) / PowerOfTen(-exponent) : double(mantissa) * PowerOfTen(exponent);
+	value = float(negative ? -result : result);
+	return true;
+}
+
+inline bool ParseInt(const char*& p, const char* end, int& value)
+{
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+	int digits = 0; value = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) value = value * 10 + (*p - '0');
+	if (negative) value = -value;
+	return digits > 0;
+}
+
+bool ParseOBJChunk(const char* p, const char* end, vector<vec3>& vertices, vector<int>& faces)
+{
+	while (p < end)
+	{
+		while (p < end && (*p == ' ' || *p == '\t')) p++;
+		if (end - p > 1 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			vec3 v; p += 2;
+			if (!ParseFloat(p, end, v.x) || !ParseFloat(p, end, v.y) || !ParseFloat(p, end, v.z)) return false;
+			vertices.push_back(v);
+		}
+		else if (end - p > 1 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			p += 2;
+			for (int k = 0; k < 3; k++)
+			{
+				int index;
+				if (!ParseInt(p, end, index)) return false;
+				faces.push_back(index - 1);
+				while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+			}
+		}
+		while (p < end && *p != '\n') p++;
+		p++;
+	}
+	return true;
+}
+
+inline int CountLeadingZeros(uint64_t x)
+{
+	if (x == 0) return 64;
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return 63 - int(index);
+#else
+	return __builtin_clzll(x);
+#endif
+}
+
+inline uint64_t ExpandBits(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffull;
+	x = (x | x << 16) & 0x1f0000ff0000ffull;
+	x = (x | x << 8) & 0x100f00f00f00f00full;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
+}
+
+inline uint64_t MortonCode(vec3 p, int bitsPerAxis)
+{
+	float scale = float((1u << bitsPerAxis) - 1);
+	uint64_t x = uint64_t(std::min(std::max(p.x * scale, 0.0f), scale));
+	uint64_t y = uint64_t(std::min(std::max(p.y * scale, 0.0f), scale));
+	uint64_t z = uint64_t(std::min(std::max(p.z * scale, 0.0f), scale));
+	return (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+}
+
+void RadixSort(vector<uint64_t>& keys, vector<int>& values, int bits, ThreadPool* pool = nullptr)
+{
+	int count = int(keys.size()), chunks = (count + parallelLoopGrain - 1) / parallelLoopGrain;
+	vector<uint64_t> keysOut(count);
+	vector<int> valuesOut(count);
+	vector<int> histograms(chunks * 256);
+
+	for (int shift = 0; shift < bits; shift += 8)
+	{
+		std::fill(histograms.begin(), histograms.end(), 0);
+		ParallelFor(pool, 0, count, parallelLoopGrain, [&](int begin, int end) {
+			int* histogram = &histograms[begin / parallelLoopGrain * 256];
+			for (int i = begin; i < end; i++) histogram[(keys[i] >> shift) & 255]++;
+		});
+
+		int offset = 0;
+		for (int digit = 0; digit < 256; digit++)
+			for (int chunk = 0; chunk < chunks; chunk++)
+			{
+				int size = histograms[chunk * 256 + digit];
+				histograms[chunk * 256 + digit] = offset;
+				offset += size;
+			}
+
+		ParallelFor(pool, 0, count, parallelLoopGrain, [&](int begin, int end) {
+			int* offsets = &histograms[begin / parallelLoopGrain * 256];
+			for (int i = begin; i < end; i++)
+			{
+				int destination = offsets[(keys[i] >> shift) & 255]++;
+				keysOut[destination] = keys[i];
+				valuesOut[destination] = values[i];
+			}
+		});
+		keys.swap(keysOut);
+		values.swap(valuesOut);
+	}
+}
+
+AABB ClipTriangleBounds(const Triangle& tri, int axis, float lo, float hi)
+{
+	vec3 polygon[8] = { tri.v0, tri.v1, tri.v2 }, clipped[8];
+	int count = 3;
+	for (int side = 0; side < 2 && count > 0; side++)
+	{
+		float plane = side == 0 ? lo : hi;
+		auto inside = [=](const vec3& p) { return side == 0 ? p[axis] >= plane : p[axis] <= plane; };
+		int clippedCount = 0;
+		for (int i = 0; i < count; i++)
+		{
+			vec3 a = polygon[i], b = polygon[(i + 1) % count];
+			if (inside(a)) clipped[clippedCount++] = a;
+			if (inside(a) != inside(b))
+			{
+				vec3 p = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+				p[axis] = plane;
+				clipped[clippedCount++] = p;
+			}
+		}
+		count = clippedCount;
+		std::copy(clipped, clipped + count, polygon);
+	}
+
+	AABB box;
+	for (int i = 0; i < count; i++) box.Expand(polygon[i]);
+	return box;
+}
+
+struct Model
+{
+	vector<Triangle> triangles;
+	vector<PrimitiveRef> references;
+	vector<uint> primitives;
+	BVHNodeArena nodeArena;
+
+	bool LoadModel(const string& filepath, ThreadPool* pool = nullptr)
+	{
+		TraceSpan trace("LoadModel", filepath.c_str());
+		MappedFile file(filepath);
+		if (!file.IsOpen()) return false;
+
+		const char* data = file.data; size_t size = file.size;
+		int chunkCount = std::max(1, std::min(pool ? pool->ThreadCount() * 4 : 1, int(size / 65536) + 1));
+		vector<size_t> chunkBounds(chunkCount + 1, size);
+		chunkBounds[0] = 0;
+		for (int i = 1; i < chunkCount; i++)
+		{
+			size_t position = std::max(chunkBounds[i - 1], size / chunkCount * i);
+			while (position > 0 && position < size && data[position - 1] != '\n') position++;
+			chunkBounds[i] = position;
+		}
+
+		struct Chunk { vector<vec3> vertices; vector<int> faces; bool valid = true; };
+		vector<Chunk> chunks(chunkCount);
+		ParallelFor(pool, 0, chunkCount, 1, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+				chunks[i].valid = ParseOBJChunk(data + chunkBounds[i], data + chunkBounds[i + 1], chunks[i].vertices, chunks[i].faces);
+		});
+
+		vector<int> vertexOffsets(chunkCount + 1, 0), faceOffsets(chunkCount + 1, 0);
+		for (int i = 0; i < chunkCount; i++)
+		{
+			if (!chunks[i].valid) return false;
+			vertexOffsets[i + 1] = vertexOffsets[i] + int(chunks[i].vertices.size());
+			faceOffsets[i + 1] = faceOffsets[i] + int(chunks[i].faces.size() / 3);
+		}
+
+		vector<vec3> vertices(vertexOffsets[chunkCount]);
+		ParallelFor(pool, 0, chunkCount, 1, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+				std::copy(chunks[i].vertices.begin(), chunks[i].vertices.end(), vertices.begin() + vertexOffsets[i]);
+		});
+
+		int vertexCount = int(vertices.size()), base = int(triangles.size());
+		atomic<bool> valid(true);
+		triangles.resize(base + faceOffsets[chunkCount], Triangle(vec3(0.0f), vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f)));
+		ParallelFor(pool, 0, chunkCount, 1, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+			{
+				const vector<int>& faces = chunks[i].faces;
+				for (size_t f = 0; f < faces.size(); f += 3)
+				{
+					int v0 = faces[f], v1 = faces[f + 1], v2 = faces[f + 2];
+					if (std::min(v0, std::min(v1, v2)) < 0 || std::max(v0, std::max(v1, v2)) >= vertexCount) { valid = false; return; }
+					triangles[base + faceOffsets[i] + f / 3] = Triangle(vertices[v0], vertices[v1], vertices[v2]);
+				}
+			}
+		});
+
+		if (!valid) triangles.erase(triangles.begin() + base, triangles.end());
+		if (valid && triangles.empty())
+		{
+			cerr << filepath << " has no faces" << endl;
+			return false;
+		}
+		return valid;
+	}
+
+	void BuildReferences(ThreadPool* pool = nullptr)
+	{
+		TraceSpan trace("BuildReferences");
+		int n = int(triangles.size());
+		references.resize(n);
+		ParallelFor(pool, 0, n, parallelLoopGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+			{
+				references[i].box = triangles[i].GetAABB();
+				references[i].centroid = (triangles[i].v0 + triangles[i].v1 + triangles[i].v2) / 3.0f;
+				references[i].index = i;
+			}
+		});
+	}
+
+	void ApplyReferences(ThreadPool* pool = nullptr)
+	{
+		TraceSpan trace("ApplyReferences");
+		primitives.clear();
+		if (triangles.empty()) return;
+		if (references.size() == triangles.size())
+		{
+			vector<Triangle> sorted(references.size(), triangles[0]);
+			ParallelFor(pool, 0, int(references.size()), parallelLoopGrain, [&](int begin, int end) {
+				for (int i = begin; i < end; i++) sorted[i] = triangles[references[i].index];
+			});
+			triangles.swap(sorted);
+		}
+		else
+		{
+			vector<int> slot(triangles.size(), -1);
+			vector<Triangle> sorted;
+			sorted.reserve(triangles.size());
+			primitives.resize(references.size());
+			for (size_t i = 0; i < references.size(); i++)
+			{
+				int& first = slot[references[i].index];
+				if (first < 0)
+				{
+					first = int(sorted.size());
+					sorted.push_back(triangles[references[i].index]);
+				}
+				primitives[i] = first;
+			}
+			triangles.swap(sorted);
+		}
+		references.clear();
+		references.shrink_to_fit();
+	}
+
+	AABB ComputeBounds(int start, int end, ThreadPool* pool = nullptr, AABB* centroidBox = nullptr)
+	{
+		auto expand = [this](int begin, int chunkEnd, AABB& box, AABB& centroids) {
+			for (int i = begin; i < chunkEnd; i++)
+			{
+				box.Expand(references[i].box);
+				centroids.Expand(references[i].centroid);
+			}
+		};
+
+		AABB box, centroids;
+		if (!pool || end - start < parallelLoopThreshold) expand(start, end, box, centroids);
+		else
+		{
+			int chunks = (end - start + parallelLoopGrain - 1) / parallelLoopGrain;
+			vector<AABB> boxes(chunks), centroidBoxes(chunks);
+			pool->ParallelFor(start, end, parallelLoopGrain, [&](int begin, int chunkEnd) {
+				int chunk = (begin - start) / parallelLoopGrain;
+				expand(begin, chunkEnd, boxes[chunk], centroidBoxes[chunk]);
+			});
+			for (int i = 0; i < chunks; i++)
+			{
+				box.Expand(boxes[i]);
+				centroids.Expand(centroidBoxes[i]);
+			}
+		}
+
+		if (centroidBox) *centroidBox = centroids;
+		return box;
+	}
+
+	template<typename Build>
+	void BuildChildren(BVHNode* node, int start, int mid, int end, ThreadPool* pool, Build build)
+	{
+		if (pool && end - start >= parallelTaskThreshold)
+		{
+			TaskGroup group(*pool);
+			group.Run([&]() { node->left = build(start, mid); });
+			node->right = build(mid, end);
+			group.Wait();
+		}
+		else
+		{
+			node->left = build(start, mid);
+			node->right = build(mid, end);
+		}
+	}
+
+	BVHNode* BuildBVH(int start, int end, ThreadPool* pool = nullptr)
+	{
+		BVHNode* node = nodeArena.Allocate(); AABB box = ComputeBounds(start, end, pool);
+		node->box = box;
+
+		int count = end - start;
+		if (count <= 4)
+		{
+			node->n = count;
+			node->index = start;
+			return node;
+		}
+
+		vec3 extent = box.max - box.min;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+		sort(references.begin() + start, references.begin() + end,
+			[axis](const PrimitiveRef& a, const PrimitiveRef& b) { return a.centroid[axis] < b.centroid[axis]; });
+
+		int mid = start + count / 2;
+		BuildChildren(node, start, mid, end, pool, [this, pool](int s, int e) { return BuildBVH(s, e, pool); });
+		return node;
+	}
+
+	BVHNode* BuildBVHSAH(int start, int end, ThreadPool* pool = nullptr)
+	{
+		BVHNode* node = nodeArena.Allocate();
+		node->box = ComputeBounds(start, end, pool);
+
+		int count = end - start;
+		if (count <= 4)
+		{
+			node->n = count;
+			node->index = start;
+			return node;
+		}
+
+		float bestCost = FLT_MAX;
+		int bestAxis = -1, bestSplit = -1;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			sort(references.begin() + start, references.begin() + end,
+				[axis](const PrimitiveRef& a, const PrimitiveRef& b) { return a.centroid[axis] < b.centroid[axis]; });
+
+			vector<AABB> prefixAABB(count), suffixAABB(count);
+			auto sweepPrefix = [&]() {
+				prefixAABB[0] = references[start].box;
+				for (int i = 1; i < count; i++)
+				{
+					prefixAABB[i] = prefixAABB[i - 1];
+					prefixAABB[i].Expand(references[start + i].box);
+				}
+			};
+			auto sweepSuffix = [&]() {
+				suffixAABB[count - 1] = references[end - 1].box;
+				for (int i = count - 2; i >= 0; i--)
+				{
+					suffixAABB[i] = suffixAABB[i + 1];
+					suffixAABB[i].Expand(references[start + i].box);
+				}
+			};
+
+			if (pool && count >= parallelLoopThreshold)
+			{
+				TaskGroup group(*pool);
+				group.Run(sweepPrefix);
+				sweepSuffix();
+				group.Wait();
+			}
+			else
+			{
+				sweepPrefix();
+				sweepSuffix();
+			}
+
+			for (int i = 1; i < count; i++)
+			{
+				float leftArea = prefixAABB[i - 1].SurfaceArea();
+				float rightArea = suffixAABB[i].SurfaceArea();
+				float cost = leftArea * i + rightArea * (count - i);
+
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+
+		sort(references.begin() + start, references.begin() + end,
+			[bestAxis](const PrimitiveRef& a, const PrimitiveRef& b) { return a.centroid[bestAxis] < b.centroid[bestAxis]; });
+
+		int mid = start + bestSplit;
+		BuildChildren(node, start, mid, end, pool, [this, pool](int s, int e) { return BuildBVHSAH(s, e, pool); });
+
+		return node;
+	}
+
+	BVHNode* BuildBVHBinnedSAH(int start, int end, int binCount = 32, ThreadPool* pool = nullptr)
+	{
+		BVHNode* node = nodeArena.Allocate();
+		AABB centroidBox;
+		node->box = ComputeBounds(start, end, pool, &centroidBox);
+
+		int count = end - start;
+		if (count <= 4)
+		{
+			node->n = count;
+			node->index = start;
+			return node;
+		}
+
+		struct Bin { AABB box; int count = 0; };
+		vector<AABB> suffixAABB(binCount);
+		vector<int> suffixCount(binCount);
+		vec3 extent = centroidBox.max - centroidBox.min;
+
+		auto binTriangles = [&](int begin, int chunkEnd, vector<Bin>& axisBins) {
+			for (int i = begin; i < chunkEnd; i++)
+			{
+				const PrimitiveRef& reference = references[i];
+				for (int axis = 0; axis < 3; axis++)
+				{
+					if (extent[axis] <= 0.0f) continue;
+					float scale = binCount / extent[axis], minCentroid = centroidBox.min[axis];
+					Bin& bin = axisBins[axis * binCount + std::min(binCount - 1, int((reference.centroid[axis] - minCentroid) * scale))];
+					bin.count++;
+					bin.box.Expand(reference.box);
+				}
+			}
+		};
+
+		vector<Bin> allBins(3 * binCount);
+		if (!pool || count < parallelLoopThreshold) binTriangles(start, end, allBins);
+		else
+		{
+			vector<vector<Bin>> chunkBins((count + parallelLoopGrain - 1) / parallelLoopGrain, vector<Bin>(3 * binCount));
+			pool->ParallelFor(start, end, parallelLoopGrain, [&](int begin, int chunkEnd) {
+				binTriangles(begin, chunkEnd, chunkBins[(begin - start) / parallelLoopGrain]);
+			});
+			for (const vector<Bin>& chunk : chunkBins)
+				for (int b = 0; b < 3 * binCount; b++)
+				{
+					allBins[b].count += chunk[b].count;
+					allBins[b].box.Expand(chunk[b].box);
+				}
+		}
+
+		float bestCost = FLT_MAX;
+		int bestAxis = -1, bestSplit = -1;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (extent[axis] <= 0.0f) continue;
+			const Bin* bins = &allBins[axis * binCount];
+
+			suffixAABB[binCount - 1] = bins[binCount - 1].box;
+			suffixCount[binCount - 1] = bins[binCount - 1].count;
+			for (int b = binCount - 2; b >= 0; b--)
+			{
+				suffixAABB[b] = suffixAABB[b + 1];
+				suffixAABB[b].Expand(bins[b].box);
+				suffixCount[b] = suffixCount[b + 1] + bins[b].count;
+			}
+
+			AABB prefixAABB; int prefixCount = 0;
+			for (int b = 1; b < binCount; b++)
+			{
+				prefixAABB.Expand(bins[b - 1].box);
+				prefixCount += bins[b - 1].count;
+				if (prefixCount == 0 || suffixCount[b] == 0) continue;
+
+				float cost = prefixAABB.SurfaceArea() * prefixCount + suffixAABB[b].SurfaceArea() * suffixCount[b];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+				}
+			}
+		}
+
+		int mid = start + count / 2;
+		if (bestAxis == -1)
+		{
+			int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+			nth_element(references.begin() + start, references.begin() + mid, references.begin() + end,
+				[axis](const PrimitiveRef& a, const PrimitiveRef& b) { return a.centroid[axis] < b.centroid[axis]; });
+		}
+		else
+		{
+			float scale = binCount / extent[bestAxis], minCentroid = centroidBox.min[bestAxis];
+			mid = partition(references.begin() + start, references.begin() + end,
+				[=](const PrimitiveRef& reference) {
+					return std::min(binCount - 1, int((reference.centroid[bestAxis] - minCentroid) * scale)) < bestSplit;
+				}) - references.begin();
+		}
+
+		BuildChildren(node, start, mid, end, pool, [this, binCount, pool](int s, int e) { return BuildBVHBinnedSAH(s, e, binCount, pool); });
+
+		return node;
+	}
+
+	BVHNode* BuildSBVH(float splitBudget = 0.3f, int binCount = 32)
+	{
+		vector<PrimitiveRef> refs, output;
+		refs.swap(references);
+		output.reserve(size_t(refs.size() * (1.0f + splitBudget)));
+
+		AABB rootBox;
+		for (const PrimitiveRef& ref : refs) rootBox.Expand(ref.box);
+		int budget = int(refs.size() * splitBudget);
+		nodeArena.Reset(2 * (int(refs.size()) + budget) + 1);
+		BVHNode* root = BuildSBVHNode(refs, rootBox.SurfaceArea(), budget, binCount, output);
+
+		references.swap(output);
+		return root;
+	}
+
+	BVHNode* BuildSBVHNode(vector<PrimitiveRef>& refs, float rootArea, int& budget, int binCount, vector<PrimitiveRef>& output)
+	{
+		const float minOverlap = 1e-5f;
+		BVHNode* node = nodeArena.Allocate();
+		for (const PrimitiveRef& ref : refs) node->box.Expand(ref.box);
+
+		int count = int(refs.size());
+		if (count <= 4)
+		{
+			node->n = count;
+			node->index = int(output.size());
+			output.insert(output.end(), refs.begin(), refs.end());
+			return node;
+		}
+
+		float bestCost = FLT_MAX;
+		int bestAxis = -1, bestSplit = -1;
+		AABB bestLeft, bestRight;
+		vector<AABB> suffixAABB(count);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			sort(refs.begin(), refs.end(), [axis](const PrimitiveRef& a, const PrimitiveRef& b) { return a.centroid[axis] < b.centroid[axis]; });
+			suffixAABB[count - 1] = refs[count - 1].box;
+			for (int i = count - 2; i >= 0; i--)
+			{
+				suffixAABB[i] = suffixAABB[i + 1];
+				suffixAABB[i].Expand(refs[i].box);
+			}
+
+			AABB prefixAABB;
+			for (int i = 1; i < count; i++)
+			{
+				prefixAABB.Expand(refs[i - 1].box);
+				float cost = prefixAABB.SurfaceArea() * i + suffixAABB[i].SurfaceArea() * (count - i);
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+					bestLeft = prefixAABB;
+					bestRight = suffixAABB[i];
+				}
+			}
+		}
+
+		AABB overlap(glm::max(bestLeft.min, bestRight.min), glm::min(bestLeft.max, bestRight.max));
+		int spatialAxis = -1, spatialSplit = -1;
+		vec3 extent = node->box.max - node->box.min;
+
+		if (budget > 0 && !overlap.IsEmpty() && overlap.SurfaceArea() > minOverlap * rootArea)
+		{
+			struct Bin { AABB box; int entries = 0, exits = 0; };
+			vector<Bin> bins(binCount);
+			vector<AABB> suffixBox(binCount);
+			vector<int> suffixExits(binCount);
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (extent[axis] <= 0.0f) continue;
+				float lo = node->box.min[axis], width = extent[axis] / binCount;
+				std::fill(bins.begin(), bins.end(), Bin());
+				for (const PrimitiveRef& ref : refs)
+				{
+					int first = SpatialBin(ref.box.min[axis], lo, width, binCount), last = SpatialBin(ref.box.max[axis], lo, width, binCount);
+					for (int b = first; b <= last; b++)
+					{
+						AABB piece = ClipReference(ref, axis, std::max(lo + b * width, ref.box.min[axis]), std::min(lo + (b + 1) * width, ref.box.max[axis]));
+						if (!piece.IsEmpty()) bins[b].box.Expand(piece);
+					}
+					bins[first].entries++;
+					bins[last].exits++;
+				}
+
+				suffixBox[binCount - 1] = bins[binCount - 1].box;
+				suffixExits[binCount - 1] = bins[binCount - 1].exits;
+				for (int b = binCount - 2; b >= 0; b--)
+				{
+					suffixBox[b] = suffixBox[b + 1];
+					suffixBox[b].Expand(bins[b].box);
+					suffixExits[b] = suffixExits[b + 1] + bins[b].exits;
+				}
+
+				AABB prefixBox; int prefixEntries = 0;
+				for (int b = 1; b < binCount; b++)
+				{
+					prefixBox.Expand(bins[b - 1].box);
+					prefixEntries += bins[b - 1].entries;
+					int rightCount = suffixExits[b];
+					if (prefixEntries == 0 || rightCount == 0) continue;
+					if (prefixEntries + rightCount - count > budget) continue;
+
+					float cost = prefixBox.SurfaceArea() * prefixEntries + suffixBox[b].SurfaceArea() * rightCount;
+					if (cost < bestCost)
+					{
+						bestCost = cost;
+						spatialAxis = axis;
+						spatialSplit = b;
+					}
+				}
+			}
+		}
+
+		vector<PrimitiveRef> left, right;
+		if (spatialAxis != -1)
+		{
+			float lo = node->box.min[spatialAxis], width = extent[spatialAxis] / binCount, plane = lo + spatialSplit * width;
+			for (const PrimitiveRef& ref : refs)
+			{
+				int first = SpatialBin(ref.box.min[spatialAxis], lo, width, binCount), last = SpatialBin(ref.box.max[spatialAxis], lo, width, binCount);
+				if (last < spatialSplit) left.push_back(ref);
+				else if (first >= spatialSplit) right.push_back(ref);
+				else
+				{
+					PrimitiveRef leftRef = ref, rightRef = ref;
+					leftRef.box = ClipReference(ref, spatialAxis, ref.box.min[spatialAxis], plane);
+					rightRef.box = ClipReference(ref, spatialAxis, plane, ref.box.max[spatialAxis]);
+					leftRef.centroid = (leftRef.box.min + leftRef.box.max) * 0.5f;
+					rightRef.centroid = (rightRef.box.min + rightRef.box.max) * 0.5f;
+					if (!leftRef.box.IsEmpty()) left.push_back(leftRef);
+					if (!rightRef.box.IsEmpty()) right.push_back(rightRef);
+					if (leftRef.box.IsEmpty() && rightRef.box.IsEmpty()) (ref.centroid[spatialAxis] < plane ? left : right).push_back(ref);
+				}
+			}
+			budget -= std::max(0, int(left.size() + right.size()) - count);
+		}
+
+		if (left.empty() || right.empty())
+		{
+			left.clear();
+			right.clear();
+			if (bestAxis != 2)
+				sort(refs.begin(), refs.end(), [bestAxis](const PrimitiveRef& a, const PrimitiveRef& b) { return a.centroid[bestAxis] < b.centroid[bestAxis]; });
+			left.assign(refs.begin(), refs.begin() + bestSplit);
+			right.assign(refs.begin() + bestSplit, refs.end());
+		}
+
+		vector<PrimitiveRef>().swap(refs);
+		node->left = BuildSBVHNode(left, rootArea, budget, binCount, output);
+		node->right = BuildSBVHNode(right, rootArea, budget, binCount, output);
+		return node;
+	}
+
+	static int SpatialBin(float position, float lo, float width, int binCount)
+	{
+		return std::max(0, std::min(binCount - 1, int((position - lo) / width)));
+	}
+
+	AABB ClipReference(const PrimitiveRef& ref, int axis, float lo, float hi) const
+	{
+		AABB clipped = ClipTriangleBounds(triangles[ref.index], axis, lo, hi);
+		return AABB(glm::max(clipped.min, ref.box.min), glm::min(clipped.max, ref.box.max));
+	}
+
+	vector<uint64_t> SortReferencesByMorton(int mortonBits = 30, ThreadPool* pool = nullptr)
+	{
+		int n = int(references.size());
+		AABB centroidBox;
+		ComputeBounds(0, n, pool, &centroidBox);
+		vec3 extent = centroidBox.max - centroidBox.min;
+		vec3 invExtent = vec3(extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f, extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+		int bitsPerAxis = mortonBits > 30 ? 21 : 10;
+
+		vector<uint64_t> codes(n);
+		vector<int> order(n);
+		ParallelFor(pool, 0, n, parallelLoopGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+			{
+				codes[i] = MortonCode((references[i].centroid - centroidBox.min) * invExtent, bitsPerAxis);
+				order[i] = i;
+			}
+		});
+		RadixSort(codes, order, 3 * bitsPerAxis, pool);
+
+		vector<PrimitiveRef> sorted(references);
+		ParallelFor(pool, 0, n, parallelLoopGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++) sorted[i] = references[order[i]];
+		});
+		references.swap(sorted);
+		return codes;
+	}
+
+	BVHNode* BuildPLOC(int radius = 16, ThreadPool* pool = nullptr)
+	{
+		int n = int(references.size());
+		if (n <= 1)
+		{
+			BVHNode* leaf = nodeArena.Allocate();
+			leaf->box = ComputeBounds(0, n);
+			leaf->n = n;
+			return leaf;
+		}
+		SortReferencesByMorton(30, pool);
+
+		vector<PLOCCluster> clusters(2 * n - 1);
+		vector<int> active(n), next(n), nearest(n), merged(n), kept(n);
+		ParallelFor(pool, 0, n, parallelLoopGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+			{
+				clusters[i].box = references[i].box;
+				clusters[i].left = -1;
+				clusters[i].right = i;
+				clusters[i].count = 1;
+				active[i] = i;
+			}
+		});
+
+		int clusterCount = n, nodeCount = n;
+		while (clusterCount > 1)
+		{
+			auto mutual = [&](int i) { return nearest[nearest[i]] == i; };
+			merged.resize(clusterCount);
+			kept.resize(clusterCount);
+			ParallelFor(pool, 0, clusterCount, parallelLoopGrain, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
+				{
+					float bestArea = FLT_MAX; int best = -1;
+					for (int j = std::max(0, i - radius); j <= std::min(clusterCount - 1, i + radius); j++)
+					{
+						if (j == i) continue;
+						AABB box = clusters[active[i]].box;
+						box.Expand(clusters[active[j]].box);
+						if (box.SurfaceArea() < bestArea)
+						{
+							bestArea = box.SurfaceArea();
+							best = j;
+						}
+					}
+					nearest[i] = best;
+				}
+			});
+
+			ParallelFor(pool, 0, clusterCount, parallelLoopGrain, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
+				{
+					merged[i] = mutual(i) && i < nearest[i];
+					kept[i] = !mutual(i) || i < nearest[i];
+				}
+			});
+			int mergeCount = ParallelExclusiveScan(pool, merged, parallelLoopGrain);
+			if (mergeCount == 0)
+			{
+				nearest[0] = 1;
+				nearest[1] = 0;
+				kept[1] = 0;
+				mergeCount = 1;
+			}
+
+			ParallelFor(pool, 0, clusterCount, parallelLoopGrain, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
+				{
+					if (!mutual(i) || i > nearest[i]) continue;
+					PLOCCluster& cluster = clusters[nodeCount + merged[i]];
+					cluster.left = active[i];
+					cluster.right = active[nearest[i]];
+					cluster.box = clusters[cluster.left].box;
+					cluster.box.Expand(clusters[cluster.right].box);
+					cluster.count = clusters[cluster.left].count + clusters[cluster.right].count;
+					active[i] = nodeCount + merged[i];
+				}
+			});
+			nodeCount += mergeCount;
+
+			int keptCount = ParallelExclusiveScan(pool, kept, parallelLoopGrain);
+			ParallelFor(pool, 0, clusterCount, parallelLoopGrain, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
+					if (!mutual(i) || i < nearest[i]) next[kept[i]] = active[i];
+			});
+			active.swap(next);
+			clusterCount = keptCount;
+		}
+
+		vector<PrimitiveRef> output(n);
+		BVHNode* root = EmitPLOC(clusters, active[0], 0, output);
+		references.swap(output);
+		return root;
+	}
+
+	BVHNode* EmitPLOC(const vector<PLOCCluster>& clusters, int index, int start, vector<PrimitiveRef>& output)
+	{
+		const int maxLeafSize = 4;
+		const PLOCCluster& cluster = clusters[index];
+		BVHNode* node = nodeArena.Allocate();
+		node->box = cluster.box;
+
+		if (cluster.count <= maxLeafSize)
+		{
+			node->n = cluster.count;
+			node->index = start;
+			int stack[maxLeafSize], top = 0, next = start;
+			stack[top++] = index;
+			while (top > 0)
+			{
+				const PLOCCluster& current = clusters[stack[--top]];
+				if (current.left == -1) output[next++] = references[current.right];
+				else
+				{
+					stack[top++] = current.right;
+					stack[top++] = current.left;
+				}
+			}
+			return node;
+		}
+
+		node->left = EmitPLOC(clusters, cluster.left, start, output);
+		node->right = EmitPLOC(clusters, cluster.right, start + clusters[cluster.left].count, output);
+		return node;
+	}
+
+	void BuildLBVH(vector<FlattenedBVHNode>& flattenedBVH, int mortonBits = 30, ThreadPool* pool = nullptr)
+	{
+		const int maxLeafSize = 4;
+		int n = int(references.size());
+		flattenedBVH.clear();
+		if (n == 0) return;
+
+		vector<uint64_t> codes = SortReferencesByMorton(mortonBits, pool);
+
+		if (n <= maxLeafSize)
+		{
+			FlattenedBVHNode leaf = {};
+			AABB box = ComputeBounds(0, n);
+			leaf.left = 0;
+			leaf.right = n;
+			leaf.count = n;
+			leaf.aabbMin = box.min;
+			leaf.aabbMax = box.max;
+			flattenedBVH.push_back(leaf);
+			return;
+		}
+
+		auto delta = [&](int i, int j) {
+			if (j < 0 || j >= n) return -1;
+			if (codes[i] == codes[j]) return 64 + CountLeadingZeros(uint64_t(i ^ j));
+			return CountLeadingZeros(codes[i] ^ codes[j]);
+		};
+
+		int internalCount = n - 1;
+		vector<int> first(internalCount), split(internalCount), last(internalCount);
+		vector<int> innerIndex(internalCount), leafIndex(internalCount);
+		ParallelFor(pool, 0, internalCount, parallelLoopGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+			{
+				int d = delta(i, i + 1) - delta(i, i - 1) > 0 ? 1 : -1;
+				int deltaMin = delta(i, i - d), lengthMax = 2;
+				while (delta(i, i + lengthMax * d) > deltaMin) lengthMax *= 2;
+
+				int length = 0;
+				for (int t = lengthMax / 2; t >= 1; t /= 2)
+					if (delta(i, i + (length + t) * d) > deltaMin) length += t;
+				int j = i + length * d, deltaNode = delta(i, j);
+
+				int s = 0, t = length;
+				do
+				{
+					t = (t + 1) / 2;
+					if (delta(i, i + (s + t) * d) > deltaNode) s += t;
+				} while (t > 1);
+
+				first[i] = std::min(i, j);
+				last[i] = std::max(i, j);
+				split[i] = i + s * d + std::min(d, 0);
+
+				bool inner = last[i] - first[i] + 1 > maxLeafSize;
+				innerIndex[i] = inner;
+				leafIndex[i] = inner ? (split[i] - first[i] + 1 <= maxLeafSize) + (last[i] - split[i] <= maxLeafSize) : 0;
+			}
+		});
+
+		vector<int> keep(innerIndex);
+		int innerCount = ParallelExclusiveScan(pool, innerIndex, parallelLoopGrain);
+		int leafCount = ParallelExclusiveScan(pool, leafIndex, parallelLoopGrain);
+		flattenedBVH.assign(innerCount + leafCount, FlattenedBVHNode());
+		vector<int> parent(innerCount + leafCount, -1);
+
+		ParallelFor(pool, 0, internalCount, parallelLoopGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+			{
+				if (!keep[i]) continue;
+				FlattenedBVHNode& node = flattenedBVH[innerIndex[i]];
+				int nextLeaf = innerCount + leafIndex[i];
+				int ranges[2][2] = { { first[i], split[i] }, { split[i] + 1, last[i] } };
+				for (int side = 0; side < 2; side++)
+				{
+					int rangeFirst = ranges[side][0], rangeLast = ranges[side][1], child;
+					if (rangeLast - rangeFirst + 1 <= maxLeafSize)
+					{
+						child = nextLeaf++;
+						FlattenedBVHNode& leaf = flattenedBVH[child];
+						AABB box = ComputeBounds(rangeFirst, rangeLast + 1);
+						leaf.left = rangeFirst;
+						leaf.right = rangeLast + 1;
+						leaf.count = rangeLast - rangeFirst + 1;
+						leaf.aabbMin = box.min;
+						leaf.aabbMax = box.max;
+					}
+					else child = innerIndex[side == 0 ? rangeLast : rangeFirst];
+					(side == 0 ? node.left : node.right) = child;
+					parent[child] = innerIndex[i];
+				}
+			}
+		});
+
+		vector<atomic<int>> visits(innerCount);
+		for (auto& visit : visits) visit = 0;
+		ParallelFor(pool, innerCount, innerCount + leafCount, parallelLoopGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+				for (int node = parent[i]; node != -1 && visits[node]++ == 1; node = parent[node])
+				{
+					FlattenedBVHNode& inner = flattenedBVH[node];
+					const FlattenedBVHNode& left = flattenedBVH[inner.left], & right = flattenedBVH[inner.right];
+					inner.aabbMin = min(left.aabbMin, right.aabbMin);
+					inner.aabbMax = max(left.aabbMax, right.aabbMax);
+				}
+		});
+	}
+
+	void SerializeBVH(vector<FlattenedBVHNode>& flattenedBVH, BVHNode* root)
+	{
+		TraceSpan trace("SerializeBVH");
+		if (!root) return;
+
+		struct PendingNode { BVHNode* node; int father; bool isLeft; };
+		queue<PendingNode> q;
+		q.push({ root, -1, false });
+
+		while (!q.empty())
+		{
+			BVHNode* node = q.front().node;
+			int father = q.front().father; bool isLeft = q.front().isLeft;
+			if (father != -1)
+			{
+				if (isLeft) flattenedBVH[father].left = flattenedBVH.size();
+				else flattenedBVH[father].right = flattenedBVH.size();
+			}
+			q.pop();
+
+			FlattenedBVHNode flatNode = {};
+			flatNode.aabbMin = node->box.min;
+			flatNode.aabbMax = node->box.max;
+
+			if (node->n > 0)
+			{
+				flatNode.left = node->index;
+				flatNode.right = node->index + node->n;
+				flatNode.count = node->n;
+			}
+			else
+			{
+				flatNode.count = 0;
+
+				if (node->left) q.push({ node->left, int(flattenedBVH.size()), true });
+				if (node->right) q.push({ node->right, int(flattenedBVH.size()), false });
+			}
+
+			flattenedBVH.push_back(flatNode);
+		}
+	}
+};
+
+void ConvertToDepthFirst(vector<FlattenedBVHNode>& flattenedBVH)
+{
+	TraceSpan trace("ConvertToDepthFirst");
+	int nodeCount = int(flattenedBVH.size());
+	if (nodeCount == 0) return;
+
+	vector<int> order, newIndex(nodeCount), subtreeSize(nodeCount, 1), stack(1, 0);
+	order.reserve(nodeCount);
+	while (!stack.empty())
+	{
+		int index = stack.back(); stack.pop_back();
+		newIndex[index] = int(order.size());
+		order.push_back(index);
+		if (flattenedBVH[index].count == 0)
+		{
+			stack.push_back(flattenedBVH[index].right);
+			stack.push_back(flattenedBVH[index].left);
+		}
+	}
+	for (int i = nodeCount - 1; i >= 0; i--)
+	{
+		const FlattenedBVHNode& node = flattenedBVH[order[i]];
+		if (node.count == 0) subtreeSize[order[i]] += subtreeSize[node.left] + subtreeSize[node.right];
+	}
+
+	vector<FlattenedBVHNode> depthFirst(nodeCount);
+	for (int i = 0; i < nodeCount; i++)
+	{
+		FlattenedBVHNode node = flattenedBVH[order[i]];
+		int skip = i + subtreeSize[order[i]];
+		if (node.count == 0)
+		{
+			node.left = newIndex[node.left];
+			node.right = newIndex[node.right];
+		}
+		node.skip = skip < nodeCount ? skip : -1;
+		depthFirst[i] = node;
+	}
+	flattenedBVH.swap(depthFirst);
+}
\ No newline at end of file
@@ -0,0 +1,102 @@
+#pragma once
+#include <cstring>
+#include "RayTraceModels.h"
+
+const uint32_t sceneCacheVersion = 2;
+
+struct SceneCacheHeader
+{
+	char magic[4]; uint32_t version;
+	uint32_t triangleSize, nodeSize;
+	uint64_t sourceHash, sourceSize;
+	char builderKey[64];
+	uint64_t triangleCount, nodeCount, primitiveCount, triangleOffset, nodeOffset, primitiveOffset;
+};
+
+uint64_t HashBytes(const char* data, size_t size, ThreadPool* pool = nullptr)
+{
+	const size_t chunkSize = 1 << 22;
+	int chunks = int((size + chunkSize - 1) / chunkSize);
+	vector<uint64_t> hashes(chunks);
+	ParallelFor(pool, 0, chunks, 1, [&](int begin, int end) {
+		for (int chunk = begin; chunk < end; chunk++)
+		{
+			uint64_t hash = 14695981039346656037ull;
+			size_t last = std::min(size, (chunk + 1) * chunkSize);
+			for (size_t i = chunk * chunkSize; i < last; i++) hash = (hash ^ uint8_t(data[i])) * 1099511628211ull;
+			hashes[chunk] = hash;
+		}
+	});
+
+	uint64_t hash = 14695981039346656037ull ^ size;
+	for (uint64_t chunkHash : hashes) hash = (hash ^ chunkHash) * 1099511628211ull;
+	return hash;
+}
+
+SceneCacheHeader MakeSceneCacheHeader(uint64_t sourceHash, uint64_t sourceSize, const string& builderKey)
+{
+	SceneCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "ARTC", 4);
+	header.version = sceneCacheVersion;
+	header.triangleSize = sizeof(Triangle);
+	header.nodeSize = sizeof(FlattenedBVHNode);
+	header.sourceHash = sourceHash;
+	header.sourceSize = sourceSize;
+	memcpy(header.builderKey, builderKey.c_str(), std::min(builderKey.size(), sizeof(header.builderKey) - 1));
+	return header;
+}
+
+bool WriteSceneCache(const string& path, SceneCacheHeader header, const vector<Triangle>& triangles, const vector<FlattenedBVHNode>& nodes, const vector<uint>& primitives)
+{
+	ofstream file(path, ios::binary | ios::trunc);
+	if (!file.is_open()) return false;
+
+	auto align = [](uint64_t offset) { return (offset + 63) & ~uint64_t(63); };
+	header.triangleCount = triangles.size();
+	header.nodeCount = nodes.size();
+	header.primitiveCount = primitives.size();
+	header.triangleOffset = align(sizeof(header));
+	header.nodeOffset = align(header.triangleOffset + sizeof(Triangle) * triangles.size());
+	header.primitiveOffset = align(header.nodeOffset + sizeof(FlattenedBVHNode) * nodes.size());
+
+	vector<char> padding(64, 0);
+	file.write((const char*)&header, sizeof(header));
+	file.write(padding.data(), header.triangleOffset - sizeof(header));
+	file.write((const char*)triangles.data(), sizeof(Triangle) * triangles.size());
+	file.write(padding.data(), header.nodeOffset - header.triangleOffset - sizeof(Triangle) * triangles.size());
+	file.write((const char*)nodes.data(), sizeof(FlattenedBVHNode) * nodes.size());
+	file.write(padding.data(), header.primitiveOffset - header.nodeOffset - sizeof(FlattenedBVHNode) * nodes.size());
+	file.write((const char*)primitives.data(), sizeof(uint) * primitives.size());
+	return bool(file);
+}
+
+struct SceneCache
+{
+public:
+	MappedFile file;
+	const SceneCacheHeader* header;
+	const Triangle* triangles; const FlattenedBVHNode* nodes; const uint* primitives;
+
+	SceneCache(const string& path) : file(path), header(nullptr), triangles(nullptr), nodes(nullptr), primitives(nullptr)
+	{
+		if (!file.IsOpen() || file.size < sizeof(SceneCacheHeader)) return;
+		const SceneCacheHeader* candidate = (const SceneCacheHeader*)file.data;
+		if (memcmp(candidate->magic, "ARTC", 4) != 0 || candidate->version != sceneCacheVersion) return;
+		if (candidate->triangleSize != sizeof(Triangle) || candidate->nodeSize != sizeof(FlattenedBVHNode)) return;
+		if (candidate->triangleOffset + candidate->triangleCount * sizeof(Triangle) > file.size) return;
+		if (candidate->nodeOffset + candidate->nodeCount * sizeof(FlattenedBVHNode) > file.size) return;
+		if (candidate->primitiveOffset + candidate->primitiveCount * sizeof(uint) > file.size) return;
+
+		header = candidate;
+		triangles = (const Triangle*)(file.data + header->triangleOffset);
+		nodes = (const FlattenedBVHNode*)(file.data + header->nodeOffset);
+		if (header->primitiveCount > 0) primitives = (const uint*)(file.data + header->primitiveOffset);
+	}
+
+	bool Matches(const SceneCacheHeader& expected) const
+	{
+		return header && header->sourceHash == expected.sourceHash && header->sourceSize == expected.sourceSize
+			&& strncmp(header->builderKey, expected.builderKey, sizeof(expected.builderKey)) == 0;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,116 @@
+#pragma once
+#include <mutex>
+#include <cstring>
+#include <thread>
+#include <condition_variable>
+#include "TraversalStats.h"
+
+const int readbackFrames = 3;
+
+struct StatsReadback
+{
+public:
+	int skippedFrames;
+
+	StatsReadback(int _width, int _height, const string& _prefix) : skippedFrames(0), width(_width), height(_height), next(0), workSlot(-1), doneSlot(-1), reporting(false), stop(false), prefix(_prefix)
+	{
+		glGenBuffers(readbackFrames, buffers);
+		for (int i = 0; i < readbackFrames; i++)
+		{
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[i]);
+			glBufferData(GL_COPY_WRITE_BUFFER, Size(), NULL, GL_STREAM_READ);
+			fences[i] = nullptr;
+			mapped[i] = nullptr;
+		}
+		worker = thread([this]() { WorkerLoop(); });
+	}
+
+	~StatsReadback() { Finish(); }
+
+	bool Capture(uint statsBuffer)
+	{
+		if (fences[next] || mapped[next]) return false;
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glBindBuffer(GL_COPY_READ_BUFFER, statsBuffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[next]);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, Size());
+		fences[next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		next = (next + 1) % readbackFrames;
+		return true;
+	}
+
+	void Update()
+	{
+		lock_guard<mutex> lock(workMutex);
+		if (doneSlot >= 0)
+		{
+			glBindBuffer(GL_COPY_READ_BUFFER, buffers[doneSlot]);
+			glUnmapBuffer(GL_COPY_READ_BUFFER);
+			mapped[doneSlot] = nullptr;
+			doneSlot = -1;
+		}
+		if (workSlot >= 0 || reporting) return;
+
+		int newest = -1;
+		for (int i = 0; i < readbackFrames; i++)
+		{
+			int slot = (next + i) % readbackFrames;
+			if (!fences[slot]) continue;
+			GLenum status = glClientWaitSync(fences[slot], 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) break;
+			if (newest >= 0) skippedFrames++;
+			glDeleteSync(fences[slot]);
+			fences[slot] = nullptr;
+			newest = slot;
+		}
+		if (newest < 0) return;
+
+		glBindBuffer(GL_COPY_READ_BUFFER, buffers[newest]);
+		mapped[newest] = (const TraversalStats*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, Size(), GL_MAP_READ_BIT);
+		if (!mapped[newest]) return;
+		workSlot = newest;
+		wakeUp.notify_one();
+	}
+
+	void Finish()
+	{
+		{
+			lock_guard<mutex> lock(workMutex);
+			stop = true;
+		}
+		wakeUp.notify_one();
+		if (worker.joinable()) worker.join();
+	}
+
+private:
+	int width, height, next, workSlot, doneSlot; bool reporting, stop;
+	string prefix;
+	uint buffers[readbackFrames]; GLsync fences[readbackFrames]; const TraversalStats* mapped[readbackFrames];
+	thread worker; mutex workMutex; condition_variable wakeUp;
+
+	size_t Size() const { return sizeof(TraversalStats) * width * height; }
+
+	void WorkerLoop()
+	{
+		vector<TraversalStats> stats(width * height);
+		unique_lock<mutex> lock(workMutex);
+		while (true)
+		{
+			wakeUp.wait(lock, [this]() { return stop || workSlot >= 0; });
+			if (workSlot < 0) return;
+
+			const TraversalStats* data = mapped[workSlot];
+			lock.unlock();
+			memcpy(stats.data(), data, Size());
+			lock.lock();
+			doneSlot = workSlot;
+			workSlot = -1;
+			reporting = true;
+
+			lock.unlock();
+			ReportTraversalStats(stats, width, height, prefix, true);
+			lock.lock();
+			reporting = false;
+		}
+	}
+};
@@ -0,0 +1,177 @@
+#pragma once
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+#include "Trace.h"
+using namespace std;
+
+struct ThreadPool
+{
+public:
+	ThreadPool(int threadCount = 0) : queues(threadCount > 0 ? threadCount : std::max(1u, thread::hardware_concurrency())), stop(false), queuedTasks(0)
+	{
+		for (int i = 1; i < ThreadCount(); i++) workers.emplace_back([this, i]() { WorkerLoop(i); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			lock_guard<mutex> lock(sleepMutex);
+			stop = true;
+		}
+		wakeUp.notify_all();
+		for (auto& worker : workers) worker.join();
+	}
+
+	int ThreadCount() const { return int(queues.size()); }
+
+	void Submit(function<void()> task)
+	{
+		if (tracingEnabled.load(memory_order_relaxed))
+		{
+			const char* span = CurrentTraceSpan();
+			task = [span, task]() { TraceSpan trace(span ? span : "Task"); task(); };
+		}
+
+		int index = CurrentIndex();
+		{
+			lock_guard<mutex> lock(queues[index].lock);
+			queues[index].tasks.push_back(std::move(task));
+		}
+		queuedTasks++;
+		{ lock_guard<mutex> lock(sleepMutex); }
+		wakeUp.notify_one();
+	}
+
+	bool RunPendingTask()
+	{
+		int index = CurrentIndex();
+		function<void()> task;
+		if (!Pop(index, task))
+		{
+			bool stolen = false;
+			for (int i = 1; i < ThreadCount() && !stolen; i++) stolen = Steal((index + i) % ThreadCount(), task);
+			if (!stolen) return false;
+		}
+		queuedTasks--;
+		task();
+		return true;
+	}
+
+	void ParallelFor(int begin, int end, int grain, const function<void(int, int)>& body);
+
+private:
+	struct WorkQueue
+	{
+		mutex lock;
+		deque<function<void()>> tasks;
+	};
+
+	vector<WorkQueue> queues;
+	vector<thread> workers;
+	mutex sleepMutex;
+	condition_variable wakeUp;
+	bool stop;
+	atomic<int> queuedTasks;
+
+	static ThreadPool*& CurrentPool() { static thread_local ThreadPool* pool = nullptr; return pool; }
+	static int& CurrentWorker() { static thread_local int worker = 0; return worker; }
+
+	int CurrentIndex() const { return CurrentPool() == this ? CurrentWorker() : 0; }
+
+	bool Pop(int index, function<void()>& task)
+	{
+		lock_guard<mutex> lock(queues[index].lock);
+		if (queues[index].tasks.empty()) return false;
+		task = std::move(queues[index].tasks.back());
+		queues[index].tasks.pop_back();
+		return true;
+	}
+
+	bool Steal(int index, function<void()>& task)
+	{
+		lock_guard<mutex> lock(queues[index].lock);
+		if (queues[index].tasks.empty()) return false;
+		task = std::move(queues[index].tasks.front());
+		queues[index].tasks.pop_front();
+		return true;
+	}
+
+	void WorkerLoop(int index)
+	{
+		CurrentPool() = this; CurrentWorker() = index;
+		while (true)
+		{
+			if (RunPendingTask()) continue;
+			unique_lock<mutex> lock(sleepMutex);
+			wakeUp.wait(lock, [this]() { return stop || queuedTasks > 0; });
+			if (stop) return;
+		}
+	}
+};
+
+struct TaskGroup
+{
+public:
+	TaskGroup(ThreadPool& _pool) : pool(_pool), pending(0) {}
+	~TaskGroup() { Wait(); }
+
+	void Run(function<void()> task)
+	{
+		pending++;
+		pool.Submit([this, task]() { task(); pending--; });
+	}
+
+	void Wait()
+	{
+		while (pending > 0)
+			if (!pool.RunPendingTask()) this_thread::yield();
+	}
+
+private:
+	ThreadPool& pool;
+	atomic<int> pending;
+};
+
+inline void ThreadPool::ParallelFor(int begin, int end, int grain, const function<void(int, int)>& body)
+{
+	TaskGroup group(*this);
+	for (int chunk = begin; chunk < end; chunk += grain)
+	{
+		int chunkEnd = std::min(chunk + grain, end);
+		if (chunkEnd == end) body(chunk, chunkEnd);
+		else group.Run([&body, chunk, chunkEnd]() { body(chunk, chunkEnd); });
+	}
+	group.Wait();
+}
+
+inline void ParallelFor(ThreadPool* pool, int begin, int end, int grain, const function<void(int, int)>& body)
+{
+	if (!pool || end - begin <= grain) body(begin, end);
+	else pool->ParallelFor(begin, end, grain, body);
+}
+
+inline int ParallelExclusiveScan(ThreadPool* pool, vector<int>& values, int grain)
+{
+	int count = int(values.size()), chunks = (count + grain - 1) / grain;
+	vector<int> chunkSums(chunks + 1, 0);
+	ParallelFor(pool, 0, count, grain, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) chunkSums[i / grain + 1] += values[i];
+	});
+	for (int i = 0; i < chunks; i++) chunkSums[i + 1] += chunkSums[i];
+	ParallelFor(pool, 0, count, grain, [&](int begin, int end) {
+		int sum = chunkSums[begin / grain];
+		for (int i = begin; i < end; i++)
+		{
+			int value = values[i];
+			values[i] = sum;
+			sum += value;
+		}
+	});
+	return chunkSums[chunks];
+}
\ No newline at end of file
@@ -0,0 +1,112 @@
+#pragma once
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+using namespace std;
+
+struct TraceEvent
+{
+	const char* name; string detail; int thread; double begin, duration;
+};
+
+atomic<bool> tracingEnabled(false);
+chrono::high_resolution_clock::time_point traceOrigin;
+vector<TraceEvent> traceEvents;
+mutex traceMutex;
+atomic<int> traceThreadCount(0);
+
+inline int TraceThread()
+{
+	static thread_local int thread = traceThreadCount++;
+	return thread;
+}
+
+inline const char*& CurrentTraceSpan() { static thread_local const char* name = nullptr; return name; }
+
+inline string EscapeJSON(const string& text)
+{
+	string escaped;
+	for (char c : text) escaped += c == '\\' || c == '"' ? string(1, '\\') + c : string(1, c);
+	return escaped;
+}
+
+struct TraceSpan
+{
+public:
+	TraceSpan(const char* _name, const char* _detail = nullptr) : name(_name), detail(_detail), parent(nullptr), active(tracingEnabled.load(memory_order_relaxed))
+	{
+		if (!active) return;
+		parent = CurrentTraceSpan();
+		CurrentTraceSpan() = name;
+		begin = chrono::high_resolution_clock::now();
+	}
+
+	~TraceSpan() { End(); }
+
+	void End()
+	{
+		if (!active) return;
+		active = false;
+		auto end = chrono::high_resolution_clock::now();
+		CurrentTraceSpan() = parent;
+		TraceEvent event = { name, detail ? detail : "", TraceThread(), chrono::duration<double, micro>(begin - traceOrigin).count(), chrono::duration<double, micro>(end - begin).count() };
+		lock_guard<mutex> lock(traceMutex);
+		traceEvents.push_back(std::move(event));
+	}
+
+private:
+	const char* name; const char* detail; const char* parent; bool active;
+	chrono::high_resolution_clock::time_point begin;
+};
+
+inline void StartTracing()
+{
+	TraceThread();
+	traceOrigin = chrono::high_resolution_clock::now();
+	tracingEnabled = true;
+}
+
+inline bool WriteTrace(const string& path)
+{
+	ofstream file(path, ios::trunc);
+	if (!file) return false;
+
+	lock_guard<mutex> lock(traceMutex);
+	vector<string> lines; char line[256];
+	for (int thread = 0; thread < traceThreadCount; thread++)
+	{
+		snprintf(line, sizeof(line), "    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": { \"name\": \"%s\" } }", thread, thread == 0 ? "main" : ("worker " + to_string(thread)).c_str());
+		lines.push_back(line);
+	}
+	for (const TraceEvent& event : traceEvents)
+	{
+		snprintf(line, sizeof(line), "    { \"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", event.name, event.thread, event.begin, event.duration);
+		lines.push_back(string(line) + (event.detail.empty() ? "" : ", \"args\": { \"detail\": \"" + EscapeJSON(event.detail) + "\" }") + " }");
+	}
+
+	file << "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [\n";
+	for (size_t i = 0; i < lines.size(); i++) file << lines[i] << (i + 1 < lines.size() ? ",\n" : "\n");
+	file << "  ]\n}\n";
+	return bool(file);
+}
+
+struct TraceSession
+{
+public:
+	TraceSession(const string& _path) : path(_path) { if (!path.empty()) StartTracing(); }
+
+	~TraceSession()
+	{
+		if (path.empty()) return;
+		tracingEnabled = false;
+		if (WriteTrace(path)) printf("Trace: %d events written to %s\n", int(traceEvents.size()), path.c_str());
+		else fprintf(stderr, "Failed to write trace %s\n", path.c_str());
+	}
+
+private:
+	string path;
+};
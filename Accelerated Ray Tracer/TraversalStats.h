@@ -0,0 +1,57 @@
+#pragma once
+#include "AcceleratedRayTracer.h"
+
+enum TraversalChannel { aabbHitsChannel, innerVisitsChannel, leafVisitsChannel, triangleTestsChannel, triangleHitsChannel, stackDepthChannel, traversalChannelCount };
+const char* traversalChannelNames[] = { "aabbHits", "innerVisits", "leafVisits", "triangleTests", "triangleHits", "stackDepth" };
+
+struct TraversalStats
+{
+	int counts[traversalChannelCount];
+};
+
+struct ChannelSummary
+{
+public:
+	double mean; int p50, p95, p99, peak;
+
+	ChannelSummary(const vector<TraversalStats>& stats, int channel) : mean(0), p50(0), p95(0), p99(0), peak(0)
+	{
+		if (stats.empty()) return;
+		vector<int> values(stats.size());
+		for (size_t i = 0; i < stats.size(); i++)
+		{
+			values[i] = stats[i].counts[channel];
+			mean += values[i];
+		}
+		mean /= values.size();
+
+		std::sort(values.begin(), values.end());
+		p50 = Percentile(values, 0.50);
+		p95 = Percentile(values, 0.95);
+		p99 = Percentile(values, 0.99);
+		peak = values.back();
+	}
+
+private:
+	static int Percentile(const vector<int>& sorted, double fraction) { return sorted[std::min(sorted.size() - 1, size_t(fraction * sorted.size()))]; }
+};
+
+void ReportTraversalStats(const vector<TraversalStats>& stats, int width, int height, const string& prefix, bool bottomUp = false)
+{
+	printf("%-14s %8s %6s %6s %6s %6s\n", "Channel", "Mean", "p50", "p95", "p99", "Max");
+	for (int channel = 0; channel < traversalChannelCount; channel++)
+	{
+		ChannelSummary summary(stats, channel);
+		printf("%-14s %8.2f %6d %6d %6d %6d\n", traversalChannelNames[channel], summary.mean, summary.p50, summary.p95, summary.p99, summary.peak);
+
+		vector<vec3> imageData(width * height);
+		float scale = summary.p99 > 0 ? 1.0f / summary.p99 : 0.0f;
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+			{
+				float normalized = std::min(1.0f, stats[(bottomUp ? height - 1 - y : y) * width + x].counts[channel] * scale);
+				imageData[y * width + x] = vec3(normalized, 1.0f - normalized, 0.0f);
+			}
+		SaveImage((prefix + "_" + traversalChannelNames[channel] + ".png").c_str(), imageData, width, height);
+	}
+}
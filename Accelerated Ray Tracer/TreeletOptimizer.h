@@ -0,0 +1,147 @@
+#pragma once
+#include <memory>
+#include "RayTraceModels.h"
+
+const int maxTreeletLeaves = 7;
+
+struct TreeletOptimizer
+{
+public:
+	TreeletOptimizer(vector<FlattenedBVHNode>& _nodes, float _traversalCost = 1.0f, float _intersectionCost = 1.0f)
+		: nodes(_nodes), traversalCost(_traversalCost), intersectionCost(_intersectionCost) {}
+
+	void Optimize(int rounds, ThreadPool* pool = nullptr)
+	{
+		TraceSpan trace("OptimizeTreelets");
+		int n = int(nodes.size());
+		if (n < 5) return;
+
+		parent.assign(n, -1);
+		cost.assign(n, 0.0f);
+		vector<int> leafNodes;
+		for (int i = 0; i < n; i++)
+		{
+			if (nodes[i].count == 0) parent[nodes[i].left] = parent[nodes[i].right] = i;
+			else leafNodes.push_back(i);
+		}
+
+		unique_ptr<atomic<int>[]> visits(new atomic<int>[n]);
+		for (int round = 0; round < rounds; round++)
+		{
+			for (int i = 0; i < n; i++) visits[i] = 0;
+			ParallelFor(pool, 0, int(leafNodes.size()), parallelTaskThreshold, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
+				{
+					int node = leafNodes[i];
+					cost[node] = Area(node) * intersectionCost * nodes[node].count;
+					for (node = parent[node]; node != -1 && visits[node]++ == 1; node = parent[node])
+					{
+						cost[node] = Area(node) * traversalCost + cost[nodes[node].left] + cost[nodes[node].right];
+						Restructure(node);
+					}
+				}
+			});
+		}
+	}
+
+private:
+	struct Treelet
+	{
+		int leaves[maxTreeletLeaves], internals[maxTreeletLeaves], leafCount, internalCount, nextInternal;
+		AABB box[1 << maxTreeletLeaves];
+		float best[1 << maxTreeletLeaves];
+		int split[1 << maxTreeletLeaves];
+	};
+
+	vector<FlattenedBVHNode>& nodes;
+	float traversalCost, intersectionCost;
+	vector<int> parent;
+	vector<float> cost;
+
+	float Area(int node) const { return AABB(nodes[node].aabbMin, nodes[node].aabbMax).SurfaceArea(); }
+
+	void Restructure(int root)
+	{
+		Treelet treelet;
+		treelet.leafCount = 0;
+		treelet.internalCount = 0;
+		treelet.nextInternal = 0;
+		treelet.leaves[treelet.leafCount++] = nodes[root].left;
+		treelet.leaves[treelet.leafCount++] = nodes[root].right;
+
+		while (treelet.leafCount < maxTreeletLeaves)
+		{
+			int widest = -1; float widestArea = -1.0f;
+			for (int i = 0; i < treelet.leafCount; i++)
+				if (nodes[treelet.leaves[i]].count == 0 && Area(treelet.leaves[i]) > widestArea)
+				{
+					widest = i;
+					widestArea = Area(treelet.leaves[i]);
+				}
+			if (widest == -1) break;
+
+			int node = treelet.leaves[widest];
+			treelet.internals[treelet.internalCount++] = node;
+			treelet.leaves[widest] = nodes[node].left;
+			treelet.leaves[treelet.leafCount++] = nodes[node].right;
+		}
+		if (treelet.leafCount < 3) return;
+
+		int all = (1 << treelet.leafCount) - 1;
+		for (int subset = 1; subset <= all; subset++)
+		{
+			int low = subset & -subset, bit = 0;
+			while (!(low >> bit & 1)) bit++;
+			if (subset == low)
+			{
+				int leaf = treelet.leaves[bit];
+				treelet.box[subset] = AABB(nodes[leaf].aabbMin, nodes[leaf].aabbMax);
+				treelet.best[subset] = cost[leaf];
+				continue;
+			}
+
+			treelet.box[subset] = treelet.box[subset ^ low];
+			treelet.box[subset].Expand(treelet.box[low]);
+
+			float bestCost = FLT_MAX; int bestSplit = 0;
+			for (int part = (subset - 1) & subset; part > 0; part = (part - 1) & subset)
+			{
+				if (!(part & low)) continue;
+				float splitCost = treelet.best[part] + treelet.best[subset ^ part];
+				if (splitCost < bestCost)
+				{
+					bestCost = splitCost;
+					bestSplit = part;
+				}
+			}
+			treelet.best[subset] = treelet.box[subset].SurfaceArea() * traversalCost + bestCost;
+			treelet.split[subset] = bestSplit;
+		}
+
+		if (treelet.best[all] >= cost[root] * (1.0f - 1e-6f)) return;
+		Emit(treelet, all, root);
+	}
+
+	int Emit(Treelet& treelet, int subset, int index)
+	{
+		if ((subset & (subset - 1)) == 0)
+		{
+			int bit = 0;
+			while (!(subset >> bit & 1)) bit++;
+			return treelet.leaves[bit];
+		}
+
+		if (index == -1) index = treelet.internals[treelet.nextInternal++];
+		int left = Emit(treelet, treelet.split[subset], -1), right = Emit(treelet, subset ^ treelet.split[subset], -1);
+
+		FlattenedBVHNode& node = nodes[index];
+		node.left = left;
+		node.right = right;
+		node.count = 0;
+		node.aabbMin = treelet.box[subset].min;
+		node.aabbMax = treelet.box[subset].max;
+		parent[left] = parent[right] = index;
+		cost[index] = treelet.best[subset];
+		return index;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,88 @@
+#pragma once
+#include "RayTraceModels.h"
+
+struct Instance
+{
+	vec4 worldToObject[3];
+	int blasRoot, pad0, pad1, pad2;
+};
+
+struct TwoLevelBVH
+{
+public:
+	vector<Instance> instances;
+	vector<FlattenedBVHNode> tlasNodes;
+
+	void Build(const vector<mat4>& objectToWorld, const vector<int>& blasRoots, const FlattenedBVHNode* blasNodes, ThreadPool* pool = nullptr)
+	{
+		int n = int(objectToWorld.size());
+		builder.references.resize(n);
+		ParallelFor(pool, 0, n, parallelLoopGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+			{
+				const FlattenedBVHNode& root = blasNodes[blasRoots[i]];
+				AABB box;
+				for (int corner = 0; corner < 8; corner++)
+				{
+					vec3 p(corner & 1 ? root.aabbMax.x : root.aabbMin.x, corner & 2 ? root.aabbMax.y : root.aabbMin.y, corner & 4 ? root.aabbMax.z : root.aabbMin.z);
+					box.Expand(vec3(objectToWorld[i] * vec4(p, 1.0f)));
+				}
+				builder.references[i].box = box;
+				builder.references[i].centroid = (box.min + box.max) * 0.5f;
+				builder.references[i].index = i;
+			}
+		});
+
+		tlasNodes.clear();
+		if (n > 0)
+		{
+			builder.nodeArena.Reset(2 * n + 1);
+			builder.SerializeBVH(tlasNodes, builder.BuildBVHBinnedSAH(0, n, 16, pool));
+		}
+
+		instances.resize(n);
+		ParallelFor(pool, 0, n, parallelLoopGrain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+			{
+				int source = builder.references[i].index;
+				mat4 worldToObject = inverse(objectToWorld[source]);
+				for (int row = 0; row < 3; row++)
+					instances[i].worldToObject[row] = vec4(worldToObject[0][row], worldToObject[1][row], worldToObject[2][row], worldToObject[3][row]);
+				instances[i].blasRoot = blasRoots[source];
+				instances[i].pad0 = instances[i].pad1 = instances[i].pad2 = 0;
+			}
+		});
+	}
+
+	static vec3 ToObject(const Instance& instance, const vec3& v, float w)
+	{
+		vec4 p(v, w);
+		return vec3(dot(instance.worldToObject[0], p), dot(instance.worldToObject[1], p), dot(instance.worldToObject[2], p));
+	}
+
+	static vec3 NormalToWorld(const Instance& instance, const vec3& n)
+	{
+		return normalize(vec3(instance.worldToObject[0]) * n.x + vec3(instance.worldToObject[1]) * n.y + vec3(instance.worldToObject[2]) * n.z);
+	}
+
+private:
+	Model builder;
+};
+
+vector<mat4> MakeInstanceGrid(const vec3& aabbMin, const vec3& aabbMax, int count, float time = 0.0f)
+{
+	vec3 extent = aabbMax - aabbMin, center = (aabbMin + aabbMax) * 0.5f;
+	float spacing = 1.5f * std::max(extent.x, std::max(extent.y, extent.z));
+	int side = int(ceil(sqrt(float(count))));
+
+	vector<mat4> transforms(count);
+	for (int i = 0; i < count; i++)
+	{
+		int column = i % side, row = i / side;
+		vec3 offset((column - (side - 1) * 0.5f) * spacing, 0.0f, -row * spacing);
+		mat4 transform = translate(mat4(1.0f), offset + center);
+		transform = rotate(transform, i * 2.39996f + (i % 3) * time, vec3(0.0f, 1.0f, 0.0f));
+		transforms[i] = translate(transform, -center);
+	}
+	return transforms;
+}
\ No newline at end of file
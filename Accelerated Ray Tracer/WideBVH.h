@@ -0,0 +1,142 @@
+#pragma once
+#include <immintrin.h>
+#include "RayTraceModels.h"
+
+template<int N>
+struct WideBVHNode
+{
+	float bounds[6][N];
+	int child[N], count[N];
+};
+
+template<int N>
+struct WideBVH
+{
+public:
+	vector<WideBVHNode<N>> nodes;
+
+	void Collapse(const FlattenedBVHNode* binary, int nodeCount)
+	{
+		nodes.clear();
+		if (nodeCount > 0) CollapseNode(binary, 0);
+	}
+
+private:
+	int CollapseNode(const FlattenedBVHNode* binary, int index)
+	{
+		int wideIndex = int(nodes.size());
+		nodes.push_back(WideBVHNode<N>());
+
+		vector<int> slots;
+		if (binary[index].count == 0) slots = { binary[index].left, binary[index].right };
+		else slots = { index };
+
+		while (int(slots.size()) < N)
+		{
+			int widest = -1; float widestArea = -1.0f;
+			for (int i = 0; i < int(slots.size()); i++)
+			{
+				const FlattenedBVHNode& node = binary[slots[i]];
+				float area = AABB(node.aabbMin, node.aabbMax).SurfaceArea();
+				if (node.count == 0 && area > widestArea)
+				{
+					widest = i;
+					widestArea = area;
+				}
+			}
+			if (widest == -1) break;
+
+			int node = slots[widest];
+			slots[widest] = binary[node].left;
+			slots.push_back(binary[node].right);
+		}
+
+		for (int i = 0; i < N; i++)
+		{
+			bool used = i < int(slots.size());
+			const FlattenedBVHNode* node = used ? &binary[slots[i]] : nullptr;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				nodes[wideIndex].bounds[axis][i] = used ? node->aabbMin[axis] : FLT_MAX;
+				nodes[wideIndex].bounds[axis + 3][i] = used ? node->aabbMax[axis] : FLT_MAX;
+			}
+			nodes[wideIndex].child[i] = used && node->count > 0 ? node->left : 0;
+			nodes[wideIndex].count[i] = used ? node->count : -1;
+		}
+
+		for (int i = 0; i < int(slots.size()); i++)
+			if (binary[slots[i]].count == 0)
+			{
+				int child = CollapseNode(binary, slots[i]);
+				nodes[wideIndex].child[i] = child;
+			}
+
+		return wideIndex;
+	}
+};
+
+template<int N>
+inline int IntersectChildren(const WideBVHNode<N>& node, const vec3& origin, const vec3& invDir, float closestT, float* tEntry)
+{
+	int mask = 0;
+	for (int i = 0; i < N; i++)
+	{
+		float tMin = 0.0f, tMax = closestT;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float t0 = (node.bounds[axis][i] - origin[axis]) * invDir[axis];
+			float t1 = (node.bounds[axis + 3][i] - origin[axis]) * invDir[axis];
+			tMin = std::max(tMin, std::min(t0, t1));
+			tMax = std::min(tMax, std::max(t0, t1));
+		}
+		tEntry[i] = tMin;
+		if (tMin <= tMax && tMin < closestT) mask |= 1 << i;
+	}
+	return mask;
+}
+
+template<int N>
+inline int IntersectFourChildren(const WideBVHNode<N>& node, int first, const vec3& origin, const vec3& invDir, float closestT, float* tEntry)
+{
+	__m128 tMin = _mm_setzero_ps(), tMax = _mm_set1_ps(closestT);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		__m128 o = _mm_set1_ps(origin[axis]), inv = _mm_set1_ps(invDir[axis]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[axis] + first), o), inv);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[axis + 3] + first), o), inv);
+		tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+		tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+	}
+	_mm_storeu_ps(tEntry + first, tMin);
+	return _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(tMin, tMax), _mm_cmplt_ps(tMin, _mm_set1_ps(closestT)))) << first;
+}
+
+template<>
+inline int IntersectChildren<4>(const WideBVHNode<4>& node, const vec3& origin, const vec3& invDir, float closestT, float* tEntry)
+{
+	return IntersectFourChildren(node, 0, origin, invDir, closestT, tEntry);
+}
+
+#ifdef __AVX__
+template<>
+inline int IntersectChildren<8>(const WideBVHNode<8>& node, const vec3& origin, const vec3& invDir, float closestT, float* tEntry)
+{
+	__m256 tMin = _mm256_setzero_ps(), tMax = _mm256_set1_ps(closestT);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		__m256 o = _mm256_set1_ps(origin[axis]), inv = _mm256_set1_ps(invDir[axis]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[axis]), o), inv);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[axis + 3]), o), inv);
+		tMin = _mm256_max_ps(tMin, _mm256_min_ps(t0, t1));
+		tMax = _mm256_min_ps(tMax, _mm256_max_ps(t0, t1));
+	}
+	_mm256_storeu_ps(tEntry, tMin);
+	return _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ), _mm256_cmp_ps(tMin, _mm256_set1_ps(closestT), _CMP_LT_OQ)));
+}
+#else
+template<>
+inline int IntersectChildren<8>(const WideBVHNode<8>& node, const vec3& origin, const vec3& invDir, float closestT, float* tEntry)
+{
+	return IntersectFourChildren(node, 0, origin, invDir, closestT, tEntry) | IntersectFourChildren(node, 4, origin, invDir, closestT, tEntry);
+}
+#endif
\ No newline at end of file